@@ -62,6 +62,8 @@
 /* Prompt strings for line input. */
 #define RV_PROMPT(S)    S ": "
 #define RVP_SEARCH      RV_PROMPT("search")
+#define RVP_FIND        RV_PROMPT("find")
+#define RVP_GREP        RV_PROMPT("grep")
 #define RVP_NEW_FILE    RV_PROMPT("new file")
 #define RVP_NEW_DIR     RV_PROMPT("new dir")
 #define RVP_RENAME      RV_PROMPT("rename")
@@ -69,10 +71,37 @@
 /* Number of entries to jump on RVK_JUMP_DOWN and RVK_JUMP_UP. */
 #define RV_JUMP         10
 
+/* Maximum number of times per second the listing is drawn again while
+   keys are coming, e.g. when one is held down.  The keys already
+   pending are always applied before drawing.  0 removes the cap. */
+#define RV_FPS          30
+
 /* Default listing view flags.
    May include SHOW_FILES, SHOW_DIRS and SHOW_HIDDEN. */
 #define RV_FLAGS        SHOW_FILES | SHOW_DIRS
 
+/* Number of threads used to stat(2) the entries of large directories
+   and to process the files of marked directories.  It can be
+   overridden at runtime with $FM_STAT_THREADS; 1 disables the worker
+   pool. */
+#define RV_STAT_THREADS 8
+
+/* Copy the files of marked directories with io_uring(7), on Linux,
+   keeping the reads and writes of many files in flight.  Leave this
+   macro undefined to copy them from the worker pool instead. */
+#define RV_URING
+
+/* Memory budget, in bytes, for the listings of the directories
+   recently visited.  An unchanged directory is shown again without
+   reading it.  0 disables the cache. */
+#define RV_CACHE_SIZE   (64 * 1024 * 1024)
+
+/* Directory, under $HOME, where copies and moves keep a journal of
+   their progress, so that those interrupted, e.g. by quitting or a
+   crash, can be resumed the next time fm is started.  Leave this macro
+   undefined to disable it. */
+#define RV_JOURNAL      ".local/state/fm"
+
 /* Optional macro to be executed when a batch operation finishes. */
 #define RV_ALERT()      beep()
 
@@ -7,10 +7,26 @@
 /* needed for some ncurses stuff */
 #define _XOPEN_SOURCE_EXTENDED
 #define _FILE_OFFSET_BITS   64
+#ifdef __linux__
+/* needed for copy_file_range(2) */
+#define _GNU_SOURCE
+#endif
 
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#endif
 
 #include <assert.h>
 #include <ctype.h>
@@ -19,20 +35,34 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define GREP_SSE2
+#endif
+
 #ifndef FM_SHELL
 #define FM_SHELL "/bin/sh"
 #endif
@@ -72,9 +102,12 @@ static char *user_pager;
 static char *user_editor;
 static char *user_open;
 
+/* Whether the collation order is the byte order, see arena_key(). */
+static int collate_bytes;
+
 /* Listing view parameters. */
 #define HEIGHT      (LINES-4)
-#define STATUSPOS   (COLS-16)
+#define STATUSPOS   (COLS-17)
 
 /* Listing view flags. */
 #define SHOW_FILES      0x01u
@@ -82,24 +115,81 @@ static char *user_open;
 #define SHOW_HIDDEN     0x04u
 
 /* Marks parameters. */
-#define BULK_INIT   5
+#define BULK_INIT   8
 #define BULK_THRESH 256
 
-/* Information associated to each entry in listing. */
-struct row {
-	char *name;
-	off_t size;
-	mode_t mode;
-	int islink;
+/*
+ * Growable buffer holding the names and the collation keys of a
+ * listing, which rows refer to by offset.  It's released in one go.
+ */
+struct arena {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+/*
+ * Entries of a listing, stored as parallel arrays so that the loops
+ * over them only touch what they need.  name, key and cells are
+ * offsets in the names arena.
+ */
+struct rows {
+	uint32_t *name;
+	uint32_t *key;
+	uint32_t *cells;	/* If R_CELLS, see row_cells(). */
+	off_t *size;
+	mode_t *mode;
+	uint8_t *flags;
+	int nalloc;
+	struct arena names;
+	size_t packed;		/* names.len, see rows_compact(). */
+};
+
+/* Row flags. */
+#define R_LINK      0x01u
+#define R_MARKED    0x02u
+#define R_CELLS     0x04u	/* Cells prepared. */
+#define R_WIDE      0x08u	/* Name not printable ASCII. */
+#define R_COUNT     0x10u	/* Size is the count of a grep. */
+
+/* Memory used by each row, besides the names. */
+#define ROWSIZ      (3 * sizeof(uint32_t) + sizeof(off_t) + \
+		    sizeof(mode_t) + sizeof(uint8_t))
+
+/*
+ * What update_view() draws of a row, prepared the first time it's
+ * shown and kept with the names.  The wide characters of the name
+ * are only needed when it isn't printable ASCII.
+ */
+struct cells {
+	int cols;		/* Width of the name. */
+	char size[16];		/* Human readable, "" for directories. */
+	wchar_t wname[];	/* If R_WIDE. */
+};
+
+/*
+ * Marked entries, in any number of directories.  Their paths are
+ * interned in a tree with one struct mpath per component, so that
+ * the marks of a deep tree share their common prefix.  The nodes are
+ * found by parent and name in an open addressing hash table of bulk
+ * slots, a power of two, with linear probing.  Removed nodes leave a
+ * MARK_DELETED tombstone so that the slots of the others don't move
+ * while the marks are walked with next_mark().
+ */
+struct mpath {
+	struct mpath *parent;
+	uint32_t hash;
+	int nrefs;		/* Children, plus one if marked. */
 	int marked;
+	char name[];		/* Component, '/'-terminated for dirs. */
 };
 
-/* Dynamic array of marked entries. */
 struct marks {
-	char dirpath[PATH_MAX];
 	int bulk;
-	int nentries;
-	char **entries;
+	int nentries;		/* Marked nodes. */
+	int nnodes;
+	int ndeleted;
+	struct mpath **entries;
 };
 
 /* Line editing state. */
@@ -116,33 +206,104 @@ struct tab {
 	char cwd[PATH_MAX];
 };
 
-struct prog {
+/* Directory scanner state, see scan_open(). */
+struct scan {
+	int fd;
+#ifdef __linux__
+	char *buf;
+	size_t len;
+	size_t off;
+#else
+	DIR *dp;
+#endif
+};
+
+/* Identity of the directory a listing was read from. */
+struct dirkey {
+	char path[PATH_MAX];
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtim;
+	struct timespec ctim;
+	uint8_t flags;
+};
+
+/* Listing being loaded in the background, see cd(). */
+struct load {
+	int active;
+	struct scan sc;
+	uint8_t flags;
+	int center;
+	char sel[PATH_MAX];
+};
+
+enum jobop { JOB_COPY, JOB_MOVE, JOB_DELETE };
+enum jobstate {
+	JOB_QUEUED, JOB_RUNNING, JOB_INTERRUPTED, JOB_DONE, JOB_FAILED,
+	JOB_CANCELLED
+};
+
+struct journal;
+
+/* Batch operation run in the background, see job_submit(). */
+struct job {
+	struct job *next;
+	int id;
+	enum jobop op;
+	enum jobstate state;
+	int paused;
+	int cancel;
+	int reported;		/* Completion shown to the user. */
+	char dst[PATH_MAX];	/* Destination root. */
+	char **src;		/* The marked entries. */
+	int *result;		/* 1 until processed. */
+	int nsrc;
+	int nerrors;
+	int dstfd;		/* Destination root, while running. */
+	int exdev;		/* Moving across file systems. */
+	struct journal *journal;	/* Of copies and moves, if any. */
+	int verify;		/* Copies are verified. */
+	char **mismatch;	/* Copies that differ from their source. */
+	int nmismatch;
+	int nshown;		/* Mismatches shown to the user. */
 	off_t partial;
 	off_t total;
-	const char *msg;
+	struct timespec start;
+	struct timespec stopped;	/* Paused at. */
+	long pausedms;
+	long ms;		/* Time spent, once over. */
 };
 
 /* Global state. */
 static struct state {
 	int tab;
 	int nfiles;
-	struct row *rows;
+	struct rows rows;
+	struct dirkey key;
+	int notify;
 	WINDOW *window;
+	struct load load;
 	struct marks marks;
 	struct edit edit;
 	int edit_scroll;
+	int verify;		/* Verify the copies, see cmd_verify(). */
+	unsigned int version;	/* Of fm.rows, see cmd_search(). */
+	char find[BUFLEN];	/* Pattern listed, see find_start(). */
+	int grep;		/* Of the contents, not the names. */
+	int wake[2];		/* Self-pipe, see wait_event(). */
 	volatile sig_atomic_t pending_usr1;
 	volatile sig_atomic_t pending_winch;
-	struct prog prog;
 	struct tab tabs[10];
 } fm;
 
 /* Macros for accessing global state. */
-#define ENAME(I)    fm.rows[I].name
-#define ESIZE(I)    fm.rows[I].size
-#define EMODE(I)    fm.rows[I].mode
-#define ISLINK(I)   fm.rows[I].islink
-#define MARKED(I)   fm.rows[I].marked
+#define ENAME(I)    (fm.rows.names.buf + fm.rows.name[I])
+#define ESIZE(I)    fm.rows.size[I]
+#define EMODE(I)    fm.rows.mode[I]
+#define ISLINK(I)   (fm.rows.flags[I] & R_LINK)
+#define MARKED(I)   (fm.rows.flags[I] & R_MARKED)
+#define SETMARK(I, M) \
+	(fm.rows.flags[I] = (fm.rows.flags[I] & ~R_MARKED) | ((M) ? R_MARKED : 0))
 #define SCROLL      fm.tabs[fm.tab].scroll
 #define ESEL        fm.tabs[fm.tab].esel
 #define FLAGS       fm.tabs[fm.tab].flags
@@ -152,6 +313,7 @@ static struct state {
 #define MIN(A, B)   ((A) < (B) ? (A) : (B))
 #define MAX(A, B)   ((A) > (B) ? (A) : (B))
 #define ISDIR(E)    (strchr((E), '/') != NULL)
+#undef CTRL		/* from <sys/ttydefaults.h> on Linux */
 #define CTRL(x)     ((x) & 0x1f)
 #define nitems(a)   (sizeof(a)/sizeof(a[0]))
 
@@ -169,8 +331,6 @@ static struct state {
 enum editstate { CONTINUE, CONFIRM, CANCEL };
 enum color { DEFAULT, RED, GREEN, YELLOW, BLUE, CYAN, MAGENTA, WHITE, BLACK };
 
-typedef int (*PROCESS)(const char *path);
-
 #ifndef __dead
 #define __dead __attribute__((noreturn))
 #endif
@@ -224,7 +384,7 @@ xasprintf(char **ret, const char *fmt, ...)
 }
 
 static inline char *
-xstrdup(char *str)
+xstrdup(const char *str)
 {
 	char *s;
 
@@ -233,108 +393,279 @@ xstrdup(char *str)
 	return s;
 }
 
+static struct mpath mark_deleted;
+#define MARK_DELETED (&mark_deleted)
+
 static void
 init_marks(struct marks *marks)
 {
-	strlcpy(marks->dirpath, "", sizeof(marks->dirpath));
 	marks->bulk = BULK_INIT;
 	marks->nentries = 0;
+	marks->nnodes = 0;
+	marks->ndeleted = 0;
 	marks->entries = xcalloc(marks->bulk, sizeof(*marks->entries));
 }
 
+/* FNV-1a of name, seeded with the parent. */
+static uint32_t
+mark_hash(const struct mpath *parent, const char *name, size_t len)
+{
+	uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)parent >> 4);
+
+	while (len--)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+/*
+ * Slot of the node name (len bytes long) under parent, or of the first
+ * free slot where it would go if it's not there.
+ */
+static int
+mark_slot(struct marks *marks, const struct mpath *parent, const char *name,
+    size_t len, uint32_t hash)
+{
+	struct mpath *p;
+	int i, mask, avail;
+
+	mask = marks->bulk - 1;
+	avail = -1;
+	for (i = hash & mask; (p = marks->entries[i]); i = (i + 1) & mask) {
+		if (p == MARK_DELETED) {
+			if (avail == -1)
+				avail = i;
+		} else if (p->hash == hash && p->parent == parent &&
+		    !strncmp(p->name, name, len) && p->name[len] == '\0')
+			return i;
+	}
+	return avail == -1 ? i : avail;
+}
+
+/* Next marked node from slot *i, or NULL at the end. */
+static struct mpath *
+next_mark(struct marks *marks, int *i)
+{
+	struct mpath *p;
+
+	while (*i < marks->bulk) {
+		p = marks->entries[(*i)++];
+		if (p != NULL && p != MARK_DELETED && p->marked)
+			return p;
+	}
+	return NULL;
+}
+
+/* Write the path of p in buf.  Return the length of its directory. */
+static size_t
+mark_path(const struct mpath *p, char *buf, size_t size)
+{
+	size_t dirlen;
+
+	if (p->parent == NULL) {
+		strlcpy(buf, p->name, size);
+		return 0;
+	}
+	mark_path(p->parent, buf, size);
+	dirlen = strlen(buf);
+	strlcat(buf, p->name, size);
+	return dirlen;
+}
+
+/* Rehash marks in a table of bulk slots, dropping the tombstones. */
+static void
+resize_marks(struct marks *marks, int bulk)
+{
+	struct mpath **old, *p;
+	int i, oldbulk;
+
+	old = marks->entries;
+	oldbulk = marks->bulk;
+	marks->entries = xcalloc(bulk, sizeof(*marks->entries));
+	marks->bulk = bulk;
+	marks->ndeleted = 0;
+	for (i = 0; i < oldbulk; i++) {
+		p = old[i];
+		if (p != NULL && p != MARK_DELETED)
+			marks->entries[mark_slot(marks, p->parent, p->name,
+			    strlen(p->name), p->hash)] = p;
+	}
+	free(old);
+}
+
+/* Find the node name (len bytes long) under parent, maybe adding it. */
+static struct mpath *
+mark_node(struct marks *marks, struct mpath *parent, const char *name,
+    size_t len, int create)
+{
+	struct mpath *p;
+	uint32_t hash;
+	int i;
+
+	hash = mark_hash(parent, name, len);
+	i = mark_slot(marks, parent, name, len, hash);
+	p = marks->entries[i];
+	if (p != NULL && p != MARK_DELETED)
+		return p;
+	if (!create)
+		return NULL;
+	/* Keep the table at most 3/4 full, tombstones included. */
+	if ((marks->nnodes + marks->ndeleted + 1) * 4 > marks->bulk * 3) {
+		resize_marks(marks, marks->nnodes * 2 >= marks->bulk ?
+		    marks->bulk * 2 : marks->bulk);
+		i = mark_slot(marks, parent, name, len, hash);
+	}
+	if (marks->entries[i] == MARK_DELETED)
+		marks->ndeleted--;
+	p = xcalloc(1, sizeof(*p) + len + 1);
+	p->parent = parent;
+	p->hash = hash;
+	memcpy(p->name, name, len);
+	marks->entries[i] = p;
+	marks->nnodes++;
+	if (parent)
+		parent->nrefs++;
+	return p;
+}
+
+/* Node of the directory dirpath, which ends with a '/'. */
+static struct mpath *
+mark_dir(struct marks *marks, const char *dirpath, int create)
+{
+	struct mpath *p;
+	const char *s, *e;
+
+	/* The root is "/", its children "name/" and so on. */
+	p = NULL;
+	for (s = dirpath; *s != '\0'; s = e + 1) {
+		if ((e = strchr(s, '/')) == NULL)
+			break;
+		if ((p = mark_node(marks, p, s, e - s + 1, create)) == NULL)
+			return NULL;
+	}
+	return p;
+}
+
+/* Drop a reference to p, removing the nodes no longer used. */
+static void
+release_mark(struct marks *marks, struct mpath *p)
+{
+	struct mpath *parent;
+
+	for (; p != NULL && --p->nrefs == 0; p = parent) {
+		parent = p->parent;
+		marks->entries[mark_slot(marks, parent, p->name,
+		    strlen(p->name), p->hash)] = MARK_DELETED;
+		marks->nnodes--;
+		marks->ndeleted++;
+		free(p);
+	}
+}
+
+static int
+is_mark(struct marks *marks, struct mpath *dir, const char *entry)
+{
+	struct mpath *p;
+
+	p = mark_node(marks, dir, entry, strlen(entry), 0);
+	return p != NULL && p->marked;
+}
+
 /* Unmark all entries. */
 static void
 mark_none(struct marks *marks)
 {
+	struct mpath *p;
 	int i;
 
-	strlcpy(marks->dirpath, "", sizeof(marks->dirpath));
-	for (i = 0; i < marks->bulk && marks->nentries; i++)
-		if (marks->entries[i]) {
-			free(marks->entries[i]);
-			marks->entries[i] = NULL;
-			marks->nentries--;
-		}
+	for (i = 0; i < marks->bulk; i++) {
+		p = marks->entries[i];
+		if (p != NULL && p != MARK_DELETED)
+			free(p);
+	}
 	if (marks->bulk > BULK_THRESH) {
 	        /* Reset bulk to free some memory. */
 		free(marks->entries);
 		marks->bulk = BULK_INIT;
 		marks->entries = xcalloc(marks->bulk, sizeof(*marks->entries));
-	}
+	} else
+		memset(marks->entries, 0,
+		    marks->bulk * sizeof(*marks->entries));
+	marks->nentries = 0;
+	marks->nnodes = 0;
+	marks->ndeleted = 0;
 }
 
 static void
-add_mark(struct marks *marks, char *dirpath, char *entry)
+add_mark(struct marks *marks, const char *dirpath, const char *entry)
 {
-	int i;
+	struct mpath *dir, *p;
 
-	if (!strcmp(marks->dirpath, dirpath)) {
-        	/* Append mark to directory. */
-		if (marks->nentries == marks->bulk) {
-			/* Expand bulk to accomodate new entry. */
-			int extra = marks->bulk / 2;
-			marks->bulk += extra; /* bulk *= 1.5; */
-			marks->entries = xrealloc(marks->entries,
-			    marks->bulk * sizeof(*marks->entries));
-			memset(&marks->entries[marks->nentries], 0,
-			    extra * sizeof(*marks->entries));
-			i = marks->nentries;
-		} else {
-			/* Search for empty slot (there must be one). */
-			for (i = 0; i < marks->bulk; i++)
-				if (!marks->entries[i])
-					break;
-		}
-	} else {
-		/* Directory changed. Discard old marks. */
-		mark_none(marks);
-		strlcpy(marks->dirpath, dirpath, sizeof(marks->dirpath));
-		i = 0;
-	}
-	marks->entries[i] = xstrdup(entry);
+	dir = mark_dir(marks, dirpath, 1);
+	p = mark_node(marks, dir, entry, strlen(entry), 1);
+	if (p->marked)
+		return;
+	p->marked = 1;
+	p->nrefs++;
 	marks->nentries++;
 }
 
 static void
-del_mark(struct marks *marks, char *entry)
+unmark(struct marks *marks, struct mpath *p)
 {
-	int i;
-
-	if (marks->nentries > 1) {
-		for (i = 0; i < marks->bulk; i++)
-			if (marks->entries[i] &&
-			    !strcmp(marks->entries[i], entry))
-				break;
-		free(marks->entries[i]);
-		marks->entries[i] = NULL;
-		marks->nentries--;
-	} else
+	if (!p->marked)
+		return;
+	p->marked = 0;
+	marks->nentries--;
+	release_mark(marks, p);
+	/* Drop the tombstones too. */
+	if (marks->nnodes == 0)
 		mark_none(marks);
 }
 
 static void
-free_marks(struct marks *marks)
+del_mark(struct marks *marks, const char *dirpath, const char *entry)
 {
-	int i;
+	struct mpath *dir, *p;
 
-	for (i = 0; i < marks->bulk && marks->nentries; i++)
-		if (marks->entries[i]) {
-			free(marks->entries[i]);
-			marks->nentries--;
-		}
+	if ((dir = mark_dir(marks, dirpath, 0)) != NULL &&
+	    (p = mark_node(marks, dir, entry, strlen(entry), 0)) != NULL)
+		unmark(marks, p);
+}
+
+static void
+free_marks(struct marks *marks)
+{
+	mark_none(marks);
 	free(marks->entries);
 }
 
+/*
+ * Interrupt wait_event().  Safe to call from signal handlers and from
+ * other threads.
+ */
+static void
+wake(void)
+{
+	int saved_errno;
+
+	saved_errno = errno;
+	/* A full pipe is already enough. */
+	write(fm.wake[1], "", 1);
+	errno = saved_errno;
+}
+
 static void
 handle_usr1(int sig)
 {
 	fm.pending_usr1 = 1;
+	wake();
 }
 
 static void
 handle_winch(int sig)
 {
 	fm.pending_winch = 1;
+	wake();
 }
 
 static void
@@ -362,6 +693,17 @@ disable_handlers(void)
 
 static void reload(void);
 static void update_view(void);
+static void try_to_sel(const char *);
+static void notify_sync(void);
+static void idle(void);
+static void jobs_idle(void);
+static int jobs_busy(void);
+static int jobs_viewing(void);
+static void jobs_status(char *, size_t);
+static const char *job_name(enum jobop);
+static struct cells *row_cells(struct rows *, int);
+static int find_busy(void);
+static void find_stop(void);
 
 /* Handle any signals received since last call. */
 static void
@@ -386,6 +728,42 @@ sync_signals(void)
 	}
 }
 
+/*
+ * getch() doesn't block: wait instead for input or for anything idle()
+ * has to deal with, i.e. signals, inotify events and the jobs, which
+ * all wake up the poll(2) here.  Only the progress of a running job,
+ * the hits of a find and the loading of a directory call for waking up
+ * anyway.
+ */
+#define JOBS_REFRESH    250	/* Progress redrawn every, in ms. */
+#define FIND_REFRESH    100	/* Hits listed every, in ms. */
+
+static void
+wait_event(void)
+{
+	struct pollfd pfd[3];
+	char buf[64];
+	int ms;
+
+	pfd[0].fd = STDIN_FILENO;
+	pfd[1].fd = fm.wake[0];
+	pfd[2].fd = fm.notify;
+	pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+	if (fm.load.active)
+		ms = 0;
+	else if (find_busy())
+		ms = FIND_REFRESH;
+	else if (jobs_busy())
+		ms = JOBS_REFRESH;
+	else
+		ms = -1;
+	/* Show what idle() drew, as getch() would before waiting. */
+	refresh();
+	if (poll(pfd, nitems(pfd), ms) > 0 && pfd[1].revents & POLLIN)
+		while (read(fm.wake[0], buf, sizeof(buf)) > 0)
+			;
+}
+
 /*
  * This function must be used in place of getch().  It handles signals
  * while waiting for user input.
@@ -395,11 +773,44 @@ fm_getch()
 {
 	int ch;
 
-	while ((ch = getch()) == ERR)
-		sync_signals();
+	while ((ch = getch()) == ERR) {
+		idle();
+		wait_event();
+	}
 	return ch;
 }
 
+/* Milliseconds elapsed since *since. */
+static long
+elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 +
+	    (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * Whether a key arrives before the next frame is due, the last one
+ * having been drawn at *frame.  The key is left to be read.
+ */
+static int
+key_pending(const struct timespec *frame)
+{
+	long wait;
+	int ch;
+
+	wait = RV_FPS > 0 ? 1000 / RV_FPS - elapsed_ms(frame) : 0;
+	timeout(wait > 0 ? wait : 0);
+	ch = getch();
+	timeout(0);
+	if (ch == ERR)
+		return 0;
+	ungetch(ch);
+	return 1;
+}
+
 /*
  * This function must be used in place of get_wch().  It handles
  * signals while waiting for user input.
@@ -409,8 +820,10 @@ fm_get_wch(wint_t *wch)
 {
 	wint_t ret;
 
-	while ((ret = get_wch(wch)) == (wint_t)ERR)
-		sync_signals();
+	while ((ret = get_wch(wch)) == (wint_t)ERR) {
+		idle();
+		wait_event();
+	}
 	return ret;
 }
 
@@ -430,6 +843,23 @@ get_user_programs()
 	FM_ENV(user_open, OPEN);
 }
 
+/* Number of stat(2) threads, from the environment or config.h. */
+static int
+get_stat_threads(void)
+{
+	const char *s;
+	char *ep;
+	long n;
+
+	if ((s = getenv("FM_STAT_THREADS")) == NULL || *s == '\0')
+		return RV_STAT_THREADS;
+	errno = 0;
+	n = strtol(s, &ep, 10);
+	if (*ep != '\0' || errno == ERANGE || n < 1 || n > 256)
+		errx(1, "FM_STAT_THREADS is invalid: %s", s);
+	return n;
+}
+
 /* Do a fork-exec to external program (e.g. $EDITOR). */
 static void
 spawn(const char *argv0, ...)
@@ -518,10 +948,17 @@ open_with_env(char *program, char *path)
 static void
 init_term()
 {
+	const char *collate;
+
 	setlocale(LC_ALL, "");
+	collate = setlocale(LC_COLLATE, NULL);
+	collate_bytes = collate == NULL || !strcmp(collate, "C") ||
+	    !strcmp(collate, "POSIX") || !strncmp(collate, "C.", 2);
+	if (pipe2(fm.wake, O_NONBLOCK | O_CLOEXEC) == -1)
+		quit("pipe2");
 	initscr();
 	raw();
-	timeout(100); /* For getch(). */
+	timeout(0); /* For getch(), see wait_event(). */
 	noecho();
 	nonl(); /* No NL->CR/NL on output. */
 	intrflush(stdscr, FALSE);
@@ -553,11 +990,15 @@ init_term()
 static void
 update_view()
 {
+	struct cells *c;
 	int i, j;
 	int numsize;
 	int ishidden;
-	int marking;
+	int cols, len;
 
+	/* Drawn once the jobs view is left. */
+	if (jobs_viewing())
+		return;
 	mvhline(0, 0, ' ', COLS);
 	attr_on(A_BOLD, NULL);
 	color_set(RVC_TABNUM, NULL);
@@ -569,8 +1010,21 @@ update_view()
 		mvaddstr(0, COLS - 3 - numsize, BUF1);
 	} else
 		numsize = -1;
+	jobs_status(BUF2, BUFLEN);
+	if (BUF2[0] != '\0') {
+		numsize += strlen(BUF2) + 1;
+		color_set(RVC_STATUS, NULL);
+		mvaddstr(0, COLS - 3 - numsize, BUF2);
+	}
 	color_set(RVC_CWD, NULL);
-	mbstowcs(WBUF, CWD, PATH_MAX);
+	if (fm.find[0] != '\0') {
+		strlcpy(BUF2, CWD, BUFLEN);
+		strlcat(BUF2, fm.grep ? " (grep " : " (find ", BUFLEN);
+		strlcat(BUF2, fm.find, BUFLEN);
+		strlcat(BUF2, ")", BUFLEN);
+		mbstowcs(WBUF, BUF2, PATH_MAX);
+	} else
+		mbstowcs(WBUF, CWD, PATH_MAX);
 	mvaddnwstr(0, 0, WBUF, COLS - 4 - numsize);
 	wcolor_set(fm.window, RVC_BORDER, NULL);
 	wborder(fm.window, 0, 0, 0, 0, 0, 0, 0, 0);
@@ -586,7 +1040,6 @@ update_view()
 		SCROLL = MIN(MAX(SCROLL, 0), fm.nfiles - HEIGHT);
 	} else
 		SCROLL = 0;
-	marking = !strcmp(CWD, fm.marks.dirpath);
 	for (i = 0, j = SCROLL; i < HEIGHT && j < fm.nfiles; i++, j++) {
 		ishidden = ENAME(j)[0] == '.';
 		if (j == ESEL)
@@ -610,32 +1063,21 @@ update_view()
 			wcolor_set(fm.window, RVC_FIFO, NULL);
 		else if (S_ISSOCK(EMODE(j)))
 			wcolor_set(fm.window, RVC_SOCK, NULL);
-		if (S_ISDIR(EMODE(j))) {
-			mbstowcs(WBUF, ENAME(j), PATH_MAX);
-			if (ISLINK(j))
-				wcslcat(WBUF, L"/", sizeof(WBUF));
-		} else {
-			const char *suffix, *suffixes = "BKMGTPEZY";
-			off_t human_size = ESIZE(j) * 10;
-			int length = mbstowcs(WBUF, ENAME(j), PATH_MAX);
-			int namecols = wcswidth(WBUF, length);
-			for (suffix = suffixes; human_size >= 10240; suffix++)
-				human_size = (human_size + 512) / 1024;
-			if (*suffix == 'B')
-				swprintf(WBUF + length, PATH_MAX - length,
-				    L"%*d %c",
-				    (int)(COLS - namecols - 6),
-				    (int)human_size / 10, *suffix);
-			else
-				swprintf(WBUF + length, PATH_MAX - length,
-				    L"%*d.%d %c",
-				    (int)(COLS - namecols - 8),
-				    (int)human_size / 10,
-				    (int)human_size % 10, *suffix);
-		}
+		c = row_cells(&fm.rows, j);
 		mvwhline(fm.window, i + 1, 1, ' ', COLS - 2);
-		mvwaddnwstr(fm.window, i + 1, 2, WBUF, COLS - 4);
-		if (marking && MARKED(j)) {
+		if (fm.rows.flags[j] & R_WIDE)
+			mvwaddnwstr(fm.window, i + 1, 2, c->wname, COLS - 4);
+		else
+			mvwaddnstr(fm.window, i + 1, 2, ENAME(j), COLS - 4);
+		cols = c->cols;
+		if (S_ISDIR(EMODE(j)) && ISLINK(j) && cols < COLS - 4) {
+			waddch(fm.window, '/');
+			cols++;
+		}
+		len = strlen(c->size);
+		if (len != 0 && cols + 1 + len <= COLS - 4)
+			mvwaddstr(fm.window, i + 1, COLS - 2 - len, c->size);
+		if (MARKED(j)) {
 			wcolor_set(fm.window, RVC_MARKS, NULL);
 			mvwaddch(fm.window, i + 1, 1, RVS_MARK);
 		} else
@@ -658,11 +1100,13 @@ update_view()
 	BUF1[0] = FLAGS & SHOW_FILES ? 'F' : ' ';
 	BUF1[1] = FLAGS & SHOW_DIRS ? 'D' : ' ';
 	BUF1[2] = FLAGS & SHOW_HIDDEN ? 'H' : ' ';
+	BUF1[3] = fm.verify ? 'V' : ' ';
+	BUF1[4] = ' ';
 	if (!fm.nfiles)
 		strlcpy(BUF2, "0/0", sizeof(BUF2));
 	else
 		snprintf(BUF2, BUFLEN, "%d/%d", ESEL + 1, fm.nfiles);
-	snprintf(BUF1 + 3, BUFLEN - 3, "%12s", BUF2);
+	snprintf(BUF1 + 5, BUFLEN - 5, "%11s", BUF2);
 	color_set(RVC_STATUS, NULL);
 	mvaddstr(LINES - 1, STATUSPOS, BUF1);
 	wrefresh(fm.window);
@@ -694,399 +1138,4090 @@ clear_message()
 	mvhline(LINES - 1, 0, ' ', STATUSPOS);
 }
 
-/* Comparison used to sort listing entries. */
-static int
-rowcmp(const void *a, const void *b)
+/*
+ * Worker pool.  pool_run() splits the range [0, n) in chunks and
+ * runs fn on them from the pool threads and the calling thread,
+ * returning once all the chunks are done.  The pool serves a single
+ * caller at a time: the jobs and the finds walk their trees from
+ * threads of their own, so it's the main thread, and a callback
+ * calling back in runs its range inline.
+ */
+#define POOL_CHUNK  64
+
+static struct pool {
+	pthread_mutex_t	 mtx;
+	pthread_mutex_t	 run;		/* Held by the caller. */
+	pthread_cond_t	 cv;
+	pthread_t	*threads;
+	int		 nthreads;
+	void		(*fn)(void *, size_t, size_t);
+	void		*arg;
+	size_t		 next;
+	size_t		 n;
+	size_t		 chunk;
+	int		 active;
+	unsigned long	 gen;
+} pool;
+
+/* Run chunks of the current job; called with pool.mtx held. */
+static void
+pool_drain(void)
 {
-	int isdir1, isdir2, cmpdir;
-	const struct row *r1 = a;
-	const struct row *r2 = b;
-	isdir1 = S_ISDIR(r1->mode);
-	isdir2 = S_ISDIR(r2->mode);
-	cmpdir = isdir2 - isdir1;
-	return cmpdir ? cmpdir : strcoll(r1->name, r2->name);
+	size_t start, end;
+
+	pool.active++;
+	while (pool.next < pool.n) {
+		start = pool.next;
+		end = MIN(start + pool.chunk, pool.n);
+		pool.next = end;
+		pthread_mutex_unlock(&pool.mtx);
+		pool.fn(pool.arg, start, end);
+		pthread_mutex_lock(&pool.mtx);
+	}
+	if (--pool.active == 0)
+		pthread_cond_broadcast(&pool.cv);
 }
 
-/* Get all entries in current working directory. */
-static int
-ls(struct row **rowsp, uint8_t flags)
+static void *
+pool_worker(void *arg)
 {
-	DIR *dp;
-	struct dirent *ep;
-	struct stat statbuf;
-	struct row *rows;
-	int i, n;
+	unsigned long gen = 0;
 
-	if (!(dp = opendir(".")))
-		return -1;
-	n = -2; /* We don't want the entries "." and "..". */
-	while (readdir(dp))
-		n++;
-	if (n == 0) {
-		closedir(dp);
-		return 0;
-	}
-	rewinddir(dp);
-	rows = xcalloc(n, sizeof(*rows));
-	i = 0;
-	while ((ep = readdir(dp))) {
-		if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
-			continue;
-		if (!(flags & SHOW_HIDDEN) && ep->d_name[0] == '.')
-			continue;
-		lstat(ep->d_name, &statbuf);
-		rows[i].islink = S_ISLNK(statbuf.st_mode);
-		stat(ep->d_name, &statbuf);
-		if (S_ISDIR(statbuf.st_mode)) {
-			if (flags & SHOW_DIRS) {
-				xasprintf(&rows[i].name, "%s%s",
-				    ep->d_name, rows[i].islink ? "" : "/");
-				rows[i].mode = statbuf.st_mode;
-				i++;
-			}
-		} else if (flags & SHOW_FILES) {
-			rows[i].name = xstrdup(ep->d_name);
-			rows[i].size = statbuf.st_size;
-			rows[i].mode = statbuf.st_mode;
-			i++;
-		}
+	pthread_mutex_lock(&pool.mtx);
+	for (;;) {
+		while (pool.gen == gen)
+			pthread_cond_wait(&pool.cv, &pool.mtx);
+		gen = pool.gen;
+		pool_drain();
 	}
-	n = i; /* Ignore unused space in array caused by filters. */
-	qsort(rows, n, sizeof(*rows), rowcmp);
-	closedir(dp);
-	*rowsp = rows;
-	return n;
+	return NULL;
 }
 
 static void
-free_rows(struct row **rowsp, int nfiles)
+pool_init(int nthreads)
 {
 	int i;
 
-	for (i = 0; i < nfiles; i++)
-		free((*rowsp)[i].name);
-	free(*rowsp);
-	*rowsp = NULL;
+	pthread_mutex_init(&pool.mtx, NULL);
+	pthread_mutex_init(&pool.run, NULL);
+	pthread_cond_init(&pool.cv, NULL);
+	pool.nthreads = MAX(nthreads - 1, 0);
+	pool.threads = xcalloc(pool.nthreads + 1, sizeof(*pool.threads));
+	for (i = 0; i < pool.nthreads; i++)
+		if (pthread_create(&pool.threads[i], NULL, pool_worker,
+		    NULL) != 0)
+			quit("pthread_create");
 }
 
-/* Change working directory to the path in CWD. */
 static void
-cd(int reset)
+pool_run(void (*fn)(void *, size_t, size_t), void *arg, size_t n,
+    size_t chunk)
 {
-	int i, j;
+	if (n <= chunk || pool.nthreads == 0 ||
+	    pthread_mutex_trylock(&pool.run) != 0) {
+		fn(arg, 0, n);
+		return;
+	}
+	pthread_mutex_lock(&pool.mtx);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.next = 0;
+	pool.n = n;
+	pool.chunk = chunk;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.cv);
+	pool_drain();
+	while (pool.next < pool.n || pool.active)
+		pthread_cond_wait(&pool.cv, &pool.mtx);
+	pthread_mutex_unlock(&pool.mtx);
+	pthread_mutex_unlock(&pool.run);
+}
 
-	message(CYAN, "Loading \"%s\"...", CWD);
-	refresh();
-	if (chdir(CWD) == -1) {
-		getcwd(CWD, PATH_MAX - 1);
-		if (CWD[strlen(CWD) - 1] != '/')
-			strlcat(CWD, "/", sizeof(CWD));
-		goto done;
+#define ARENA_MIN   (16 * 1024)
+
+/* Reserve len bytes in a and return their offset. */
+static uint32_t
+arena_alloc(struct arena *a, size_t len)
+{
+	uint32_t off;
+
+	if (a->len + len > UINT32_MAX) {
+		errno = ENOMEM;
+		quit("arena_alloc");
 	}
-	if (reset)
-		ESEL = SCROLL = 0;
-	if (fm.nfiles)
-		free_rows(&fm.rows, fm.nfiles);
-	fm.nfiles = ls(&fm.rows, FLAGS);
-	if (!strcmp(CWD, fm.marks.dirpath)) {
-		for (i = 0; i < fm.nfiles; i++) {
-			for (j = 0; j < fm.marks.bulk; j++)
-				if (fm.marks.entries[j] &&
-				    !strcmp(fm.marks.entries[j], ENAME(i)))
-					break;
-			MARKED(i) = j < fm.marks.bulk;
-		}
-	} else
-		for (i = 0; i < fm.nfiles; i++)
-			MARKED(i) = 0;
-done:
-	clear_message();
-	update_view();
+	if (a->len + len > a->size) {
+		a->size = MAX(a->size * 2, MAX(a->len + len, ARENA_MIN));
+		a->buf = xrealloc(a->buf, a->size);
+	}
+	off = a->len;
+	a->len += len;
+	return off;
 }
 
-/* Select a target entry, if it is present. */
 static void
-try_to_sel(const char *target)
+arena_free(struct arena *a)
 {
-	ESEL = 0;
-	if (!ISDIR(target))
-		while ((ESEL + 1) < fm.nfiles && S_ISDIR(EMODE(ESEL)))
-			ESEL++;
-	while ((ESEL + 1) < fm.nfiles && strcoll(ENAME(ESEL), target) < 0)
-		ESEL++;
+	free(a->buf);
+	memset(a, 0, sizeof(*a));
 }
 
-/* Reload CWD, but try to keep selection. */
+/* Make room for n rows. */
 static void
-reload()
+rows_grow(struct rows *r, int n)
 {
-	if (fm.nfiles) {
-		strlcpy(INPUT, ENAME(ESEL), sizeof(INPUT));
-		cd(0);
-		try_to_sel(INPUT);
-		update_view();
-	} else
-		cd(1);
+	if (n <= r->nalloc)
+		return;
+	r->nalloc = MAX(n, r->nalloc ? r->nalloc * 2 : 64);
+	r->name = xrealloc(r->name, r->nalloc * sizeof(*r->name));
+	r->key = xrealloc(r->key, r->nalloc * sizeof(*r->key));
+	r->cells = xrealloc(r->cells, r->nalloc * sizeof(*r->cells));
+	r->size = xrealloc(r->size, r->nalloc * sizeof(*r->size));
+	r->mode = xrealloc(r->mode, r->nalloc * sizeof(*r->mode));
+	r->flags = xrealloc(r->flags, r->nalloc * sizeof(*r->flags));
 }
 
-static off_t
-count_dir(const char *path)
+/* Move n rows from src to dst, which may overlap. */
+static void
+rows_move(struct rows *r, int dst, int src, int n)
 {
-	DIR *dp;
-	struct dirent *ep;
-	struct stat statbuf;
-	char subpath[PATH_MAX];
-	off_t total;
+	memmove(&r->name[dst], &r->name[src], n * sizeof(*r->name));
+	memmove(&r->key[dst], &r->key[src], n * sizeof(*r->key));
+	memmove(&r->cells[dst], &r->cells[src], n * sizeof(*r->cells));
+	memmove(&r->size[dst], &r->size[src], n * sizeof(*r->size));
+	memmove(&r->mode[dst], &r->mode[src], n * sizeof(*r->mode));
+	memmove(&r->flags[dst], &r->flags[src], n * sizeof(*r->flags));
+}
 
-	if (!(dp = opendir(path)))
-		return 0;
-	total = 0;
-	while ((ep = readdir(dp))) {
-		if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
-			continue;
-		snprintf(subpath, PATH_MAX, "%s%s", path, ep->d_name);
-		lstat(subpath, &statbuf);
-		if (S_ISDIR(statbuf.st_mode)) {
-			strlcat(subpath, "/", sizeof(subpath));
-			total += count_dir(subpath);
-		} else
-			total += statbuf.st_size;
-	}
-	closedir(dp);
-	return total;
+static void
+rows_free(struct rows *r)
+{
+	free(r->name);
+	free(r->key);
+	free(r->cells);
+	free(r->size);
+	free(r->mode);
+	free(r->flags);
+	arena_free(&r->names);
+	memset(r, 0, sizeof(*r));
 }
 
-static off_t
-count_marked()
+/*
+ * The rows removed, or read again, leave their name, key and cells in
+ * the arena.  Once it has doubled since it was last compacted, copy
+ * the names and keys of the first n rows to a new one; the cells are
+ * prepared again when drawn.
+ */
+static void
+rows_compact(struct rows *r, int n)
 {
+	struct arena a;
+	const char *s;
+	size_t len;
+	uint32_t off;
 	int i;
-	char *entry;
-	off_t total;
-	struct stat statbuf;
-
-	total = 0;
-	chdir(fm.marks.dirpath);
-	for (i = 0; i < fm.marks.bulk; i++) {
-		entry = fm.marks.entries[i];
-		if (entry) {
-			if (ISDIR(entry)) {
-				total += count_dir(entry);
-			} else {
-				lstat(entry, &statbuf);
-				total += statbuf.st_size;
-			}
+
+	if (r->packed == 0)
+		r->packed = r->names.len;
+	if (r->names.len <= 2 * r->packed)
+		return;
+	memset(&a, 0, sizeof(a));
+	for (i = 0; i < n; i++) {
+		s = r->names.buf + r->name[i];
+		len = strlen(s) + 1;
+		off = arena_alloc(&a, len);
+		memcpy(a.buf + off, s, len);
+		if (r->key[i] == r->name[i])
+			r->key[i] = off;
+		else {
+			s = r->names.buf + r->key[i];
+			len = strlen(s) + 1;
+			r->key[i] = arena_alloc(&a, len);
+			memcpy(a.buf + r->key[i], s, len);
 		}
+		r->name[i] = off;
+		r->flags[i] &= ~(R_CELLS | R_WIDE);
 	}
-	chdir(CWD);
-	return total;
+	arena_free(&r->names);
+	r->names = a;
+	r->packed = a.len;
+}
+
+/* Format size in a human readable form, e.g. "12.3 M". */
+static void
+human_size(char *buf, size_t len, off_t size)
+{
+	const char *suffix, *suffixes = "BKMGTPEZY";
+	off_t n = size * 10;
+
+	for (suffix = suffixes; n >= 10240; suffix++)
+		n = (n + 512) / 1024;
+	if (*suffix == 'B')
+		snprintf(buf, len, "%d %c", (int)n / 10, *suffix);
+	else
+		snprintf(buf, len, "%d.%d %c", (int)n / 10, (int)n % 10,
+		    *suffix);
 }
 
 /*
- * Recursively process a source directory using CWD as destination
- * root.  For each node (i.e. directory), do the following:
- *
- * 1. call pre(destination);
- * 2. call proc() on every child leaf (i.e. files);
- * 3. recurse into every child node;
- * 4. call pos(source).
- *
- * E.g. to move directory /src/ (and all its contents) inside /dst/:
- * strlcpy(CWD, "/dst/", sizeof(CWD));
- * process_dir(adddir, movfile, deldir, "/src/");
+ * Cells of the row i of r, prepared the first time they're asked for.
+ * Invalid and unprintable characters of the name are shown as '?'.
  */
-static int
-process_dir(PROCESS pre, PROCESS proc, PROCESS pos, const char *path)
+static struct cells *
+row_cells(struct rows *r, int i)
 {
-	int ret;
-	DIR *dp;
-	struct dirent *ep;
-	struct stat statbuf;
-	char subpath[PATH_MAX];
+	const unsigned char *p;
+	const char *name, *end;
+	struct cells *c;
+	mbstate_t mbs;
+	wchar_t wc;
+	size_t len, n;
+	int w;
+
+	if (r->flags[i] & R_CELLS)
+		return (struct cells *)(r->names.buf + r->cells[i]);
+	name = r->names.buf + r->name[i];
+	for (p = (const unsigned char *)name; *p >= ' ' && *p < 0x7f; p++)
+		;
+	n = p - (const unsigned char *)name;
+	len = *p == '\0' ? 0 : strlen(name) + 1;
+	/* The buffer of the arena is suitably aligned, its offsets not. */
+	r->names.len = (r->names.len + __alignof__(struct cells) - 1) &
+	    ~(__alignof__(struct cells) - 1);
+	r->cells[i] = arena_alloc(&r->names,
+	    sizeof(*c) + len * sizeof(wchar_t));
+	c = (struct cells *)(r->names.buf + r->cells[i]);
+	name = r->names.buf + r->name[i];
+	c->cols = n;
+	if (len != 0) {
+		r->flags[i] |= R_WIDE;
+		memset(&mbs, 0, sizeof(mbs));
+		end = name + len - 1;
+		for (c->cols = n = 0; name < end; n++, name += len) {
+			len = mbrtowc(&wc, name, end - name, &mbs);
+			if (len == (size_t)-1 || len == (size_t)-2) {
+				memset(&mbs, 0, sizeof(mbs));
+				wc = L'?';
+				len = 1;
+			}
+			if ((w = wcwidth(wc)) < 0) {
+				wc = L'?';
+				w = 1;
+			}
+			c->wname[n] = wc;
+			c->cols += w;
+		}
+		c->wname[n] = L'\0';
+	}
+	c->size[0] = '\0';
+	if (r->flags[i] & R_COUNT)
+		snprintf(c->size, sizeof(c->size), "%lld",
+		    (long long)r->size[i]);
+	else if (!S_ISDIR(r->mode[i]))
+		human_size(c->size, sizeof(c->size), r->size[i]);
+	r->flags[i] |= R_CELLS;
+	return c;
+}
 
-	ret = 0;
-	if (pre) {
-		char dstpath[PATH_MAX];
-		strlcpy(dstpath, CWD, sizeof(dstpath));
-		strlcat(dstpath, path + strlen(fm.marks.dirpath),
-		    sizeof(dstpath));
-		ret |= pre(dstpath);
-	}
-	if (!(dp = opendir(path)))
+/*
+ * Collation key of the name at offset name of a: comparing two keys
+ * with strcmp(3) gives the same result as strcoll(3) on the names.
+ * In the C locales (and in C.UTF-8, which collates by code point)
+ * the name is its own key.
+ */
+static uint32_t
+arena_key(struct arena *a, uint32_t name)
+{
+	uint32_t key;
+	size_t len;
+
+	if (collate_bytes)
+		return name;
+	len = strxfrm(NULL, a->buf + name, 0) + 1;
+	key = arena_alloc(a, len);
+	strxfrm(a->buf + key, a->buf + name, len);
+	return key;
+}
+
+/*
+ * The keys of many rows are computed in parallel in two passes: the
+ * first one gets their size, then their space is taken from the
+ * arena and the second pass fills it.
+ */
+struct keyjob {
+	struct rows *rows;
+	int first;
+	size_t *lens;
+};
+
+static void
+keylen_rows(void *arg, size_t start, size_t end)
+{
+	struct keyjob *job = arg;
+	struct rows *r = job->rows;
+	size_t i;
+
+	for (i = start; i < end; i++)
+		job->lens[i] = strxfrm(NULL,
+		    r->names.buf + r->name[job->first + i], 0) + 1;
+}
+
+static void
+keyfill_rows(void *arg, size_t start, size_t end)
+{
+	struct keyjob *job = arg;
+	struct rows *r = job->rows;
+	size_t i;
+
+	for (i = start; i < end; i++)
+		strxfrm(r->names.buf + r->key[job->first + i],
+		    r->names.buf + r->name[job->first + i], job->lens[i]);
+}
+
+/* Compute the keys of the n rows from first. */
+static void
+key_rows(struct rows *r, int first, int n)
+{
+	struct keyjob job;
+	int i;
+
+	if (n == 0)
+		return;
+	if (collate_bytes) {
+		memcpy(&r->key[first], &r->name[first], n * sizeof(*r->key));
+		return;
+	}
+	job.rows = r;
+	job.first = first;
+	job.lens = xcalloc(n, sizeof(*job.lens));
+	pool_run(keylen_rows, &job, n, POOL_CHUNK);
+	for (i = 0; i < n; i++)
+		r->key[first + i] = arena_alloc(&r->names, job.lens[i]);
+	pool_run(keyfill_rows, &job, n, POOL_CHUNK);
+	free(job.lens);
+}
+
+/*
+ * Sort the keys of a listing from the byte depth on with an MSD radix
+ * sort.  The sort is done on an array of (key, row index) pairs, so
+ * that the rows are moved only once at the end, and the byte of each
+ * key for the current depth is read once in the cache array.  Small
+ * buckets, and the rare very long common prefixes, are left to an
+ * insertion sort and to qsort(3).
+ */
+#define RADIX_MIN   32
+#define RADIX_DEPTH 256
+
+struct sortkey {
+	uint32_t key;
+	uint32_t idx;
+};
+
+static const char *radix_base;
+static size_t radix_depth;
+
+#define RADIX_KEY(K, D) (radix_base + (K).key + (D))
+
+static int
+sortkeycmp(const void *a, const void *b)
+{
+	const struct sortkey *k1 = a;
+	const struct sortkey *k2 = b;
+
+	return strcmp(RADIX_KEY(*k1, radix_depth), RADIX_KEY(*k2, radix_depth));
+}
+
+static void
+radix_sort(struct sortkey *keys, struct sortkey *tmp, unsigned char *cache,
+    int n, size_t depth)
+{
+	struct sortkey k;
+	int count[256], pos[256];
+	int i, j, c;
+
+	if (n < RADIX_MIN) {
+		for (i = 1; i < n; i++) {
+			k = keys[i];
+			for (j = i; j > 0 && strcmp(RADIX_KEY(keys[j - 1],
+			    depth), RADIX_KEY(k, depth)) > 0; j--)
+				keys[j] = keys[j - 1];
+			keys[j] = k;
+		}
+		return;
+	}
+	if (depth >= RADIX_DEPTH) {
+		radix_depth = depth;
+		qsort(keys, n, sizeof(*keys), sortkeycmp);
+		return;
+	}
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		count[cache[i] = *RADIX_KEY(keys[i], depth)]++;
+	for (c = j = 0; c < 256; c++) {
+		pos[c] = j;
+		j += count[c];
+	}
+	for (i = 0; i < n; i++)
+		tmp[pos[cache[i]]++] = keys[i];
+	memcpy(keys, tmp, n * sizeof(*keys));
+	/* Bucket 0 holds the keys that end here: they're all equal. */
+	for (c = 1, j = count[0]; c < 256; j += count[c++])
+		if (count[c] > 1)
+			radix_sort(keys + j, tmp + j, cache + j, count[c],
+			    depth + 1);
+}
+
+/* Reorder the n elements of size width of array as in keys. */
+static void
+permute(void *array, size_t width, const struct sortkey *keys, int n,
+    void *tmp)
+{
+	char *a = array, *t = tmp;
+	int i;
+
+	for (i = 0; i < n; i++)
+		memcpy(t + i * width, a + keys[i].idx * width, width);
+	memcpy(a, t, n * width);
+}
+
+/* Sort the first n rows with the directories first, see row_lower(). */
+static void
+sort_rows(struct rows *r, int n)
+{
+	struct sortkey *keys, *tmp;
+	unsigned char *cache;
+	int i, ndirs, nfiles;
+
+	if (n < 2)
+		return;
+	keys = xcalloc(n, sizeof(*keys));
+	tmp = xcalloc(n, sizeof(*tmp));
+	cache = xcalloc(n, 1);
+	for (i = ndirs = nfiles = 0; i < n; i++)
+		if (S_ISDIR(r->mode[i]))
+			keys[ndirs++] = (struct sortkey){r->key[i], i};
+		else
+			keys[n - ++nfiles] = (struct sortkey){r->key[i], i};
+	radix_base = r->names.buf;
+	radix_sort(keys, tmp, cache, ndirs, 0);
+	radix_sort(keys + ndirs, tmp, cache, nfiles, 0);
+	free(cache);
+	/* tmp is as large as the widest column. */
+	permute(r->name, sizeof(*r->name), keys, n, tmp);
+	permute(r->key, sizeof(*r->key), keys, n, tmp);
+	permute(r->cells, sizeof(*r->cells), keys, n, tmp);
+	permute(r->size, sizeof(*r->size), keys, n, tmp);
+	permute(r->mode, sizeof(*r->mode), keys, n, tmp);
+	permute(r->flags, sizeof(*r->flags), keys, n, tmp);
+	free(tmp);
+	free(keys);
+}
+
+/*
+ * Directory scanner.  Entries are read once, in large chunks, and
+ * are returned together with their d_type so that the callers can
+ * avoid a stat(2) whenever the type alone is enough.
+ */
+#define SCANBUFSIZ  (128 * 1024)
+
+#ifdef __linux__
+struct linux_dirent64 {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+#endif
+
+/* Scan the directory open on fd, which is closed by scan_close(). */
+static int
+scan_fd(struct scan *sc, int fd)
+{
+	memset(sc, 0, sizeof(*sc));
+	if ((sc->fd = fd) == -1)
 		return -1;
-	while ((ep = readdir(dp))) {
-		if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+#ifdef __linux__
+	if ((sc->buf = malloc(SCANBUFSIZ)) == NULL)
+		quit("malloc");
+#else
+	if ((sc->dp = fdopendir(sc->fd)) == NULL) {
+		close(sc->fd);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static int
+scan_open(struct scan *sc, int dirfd, const char *path)
+{
+	return scan_fd(sc, openat(dirfd, path,
+	    O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+}
+
+/* Return the next entry, skipping "." and "..", or NULL at the end. */
+static const char *
+scan_next(struct scan *sc, int *type)
+{
+	const char *name;
+#ifdef __linux__
+	struct linux_dirent64 *d;
+	long r;
+
+	for (;;) {
+		if (sc->off >= sc->len) {
+			r = syscall(SYS_getdents64, sc->fd, sc->buf,
+			    SCANBUFSIZ);
+			if (r <= 0)
+				return NULL;
+			sc->len = r;
+			sc->off = 0;
+		}
+		d = (struct linux_dirent64 *)(sc->buf + sc->off);
+		sc->off += d->d_reclen;
+		name = d->d_name;
+		*type = d->d_type;
+#else
+	struct dirent *ep;
+
+	for (;;) {
+		if ((ep = readdir(sc->dp)) == NULL)
+			return NULL;
+		name = ep->d_name;
+		*type = ep->d_type;
+#endif
+		if (name[0] == '.' && (name[1] == '\0' ||
+		    (name[1] == '.' && name[2] == '\0')))
 			continue;
-		snprintf(subpath, PATH_MAX, "%s%s", path, ep->d_name);
-		lstat(subpath, &statbuf);
-		if (S_ISDIR(statbuf.st_mode)) {
-			strcat(subpath, "/");
-			ret |= process_dir(pre, proc, pos, subpath);
+		return name;
+	}
+}
+
+static void
+scan_close(struct scan *sc)
+{
+#ifdef __linux__
+	free(sc->buf);
+	close(sc->fd);
+#else
+	closedir(sc->dp);
+#endif
+}
+
+/*
+ * Walk of a directory tree, without recursion nor paths.  The
+ * directories to walk are kept in a stack shared by the threads
+ * calling walk_run(), so that the subtrees are walked in parallel.
+ * Each directory is opened relative to its parent, which is kept open
+ * until all of its subdirectories are done, and the callbacks get the
+ * entries relative to the fd of their directory:
+ *
+ * 1. enter(), if any, once the directory is open;
+ * 2. leaf() on each entry that isn't a directory according to d_type;
+ *    it returns 1 if the entry turns out to be one, so that it's
+ *    walked too;
+ * 3. leave(), if any, once its subdirectories are done.
+ *
+ * A root that isn't a directory, e.g. a symbolic link to one, is given
+ * to leaf() with a NULL directory.  The callbacks return -1 on error,
+ * which is reported in err, and add the work they do to *units, which
+ * step() is given every WALK_STEP entries and before each directory:
+ * if it returns nonzero the walk stops, leaving the rest alone.
+ */
+#define WALK_STEP   256
+
+struct wnode {
+	struct wnode *parent;
+	int fd;
+	int ufd;		/* Of the callbacks, closed along fd. */
+	uint64_t key;		/* Of the callbacks too. */
+	int pending;		/* Subdirectories left, +1 while scanned. */
+	char name[];
+};
+
+struct walk {
+	int		 (*enter)(struct walk *, struct wnode *);
+	int		 (*leaf)(struct walk *, struct wnode *, const char *,
+			    int, off_t *);
+	int		 (*leave)(struct walk *, struct wnode *);
+	int		 (*step)(struct walk *, off_t);
+	void		*arg;
+	pthread_mutex_t	 mtx;
+	pthread_cond_t	 cv;
+	struct wnode	**stack;
+	int		 nstack;
+	int		 nalloc;
+	int		 busy;		/* Threads walking a directory. */
+	int		 stop;
+	int		 err;
+};
+
+static void
+walk_init(struct walk *w)
+{
+	pthread_mutex_init(&w->mtx, NULL);
+	pthread_cond_init(&w->cv, NULL);
+	w->enter = w->leave = NULL;
+	w->leaf = NULL;
+	w->step = NULL;
+	w->arg = NULL;
+	w->stack = NULL;
+	w->nstack = w->nalloc = w->busy = w->stop = w->err = 0;
+}
+
+static void
+walk_free(struct walk *w)
+{
+	pthread_mutex_destroy(&w->mtx);
+	pthread_cond_destroy(&w->cv);
+	free(w->stack);
+}
+
+static void
+walk_fail(struct walk *w)
+{
+	__atomic_store_n(&w->err, 1, __ATOMIC_RELAXED);
+}
+
+static void
+walk_stop(struct walk *w)
+{
+	__atomic_store_n(&w->stop, 1, __ATOMIC_RELAXED);
+}
+
+/* Push name, in parent or, if NULL, a root path. */
+static void
+walk_push(struct walk *w, struct wnode *parent, const char *name)
+{
+	struct wnode *n;
+	size_t len;
+
+	len = strlen(name);
+	n = xcalloc(1, sizeof(*n) + len + 1);
+	memcpy(n->name, name, len);
+	/* O_NOFOLLOW doesn't apply to "link/". */
+	if (parent == NULL && len > 1 && name[len - 1] == '/')
+		n->name[len - 1] = '\0';
+	n->parent = parent;
+	n->fd = n->ufd = -1;
+	n->pending = 1;
+	if (parent != NULL)
+		__atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&w->mtx);
+	if (w->nstack == w->nalloc) {
+		w->nalloc = w->nalloc ? w->nalloc * 2 : 64;
+		w->stack = xrealloc(w->stack, w->nalloc * sizeof(*w->stack));
+	}
+	w->stack[w->nstack++] = n;
+	pthread_cond_signal(&w->cv);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+/* Done with the entries of n: leave it, and its parents done too. */
+static void
+walk_done(struct walk *w, struct wnode *n)
+{
+	struct wnode *parent;
+
+	for (; n != NULL && __atomic_sub_fetch(&n->pending, 1,
+	    __ATOMIC_ACQ_REL) == 0; n = parent) {
+		parent = n->parent;
+		if (n->fd != -1 && w->leave != NULL) {
+			if (__atomic_load_n(&w->stop, __ATOMIC_RELAXED))
+				walk_fail(w);
+			else if (w->leave(w, n) == -1)
+				walk_fail(w);
+		}
+		if (n->fd != -1)
+			close(n->fd);
+		if (n->ufd != -1)
+			close(n->ufd);
+		free(n);
+	}
+}
+
+/* Walk the entries of n, pushing its subdirectories. */
+static void
+walk_dir(struct walk *w, struct wnode *n)
+{
+	struct scan sc;
+	const char *name;
+	off_t units;
+	int pfd, type, ret, left;
+
+	units = 0;
+	pfd = n->parent ? n->parent->fd : AT_FDCWD;
+	n->fd = openat(pfd, n->name,
+	    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (n->fd == -1) {
+		/* Not a directory, at least not anymore. */
+		if ((errno != ENOTDIR && errno != ELOOP) ||
+		    w->leaf(w, n->parent, n->name, DT_UNKNOWN, &units) != 0)
+			walk_fail(w);
+		else if (units && w->step != NULL && w->step(w, units))
+			walk_stop(w);
+		walk_done(w, n);
+		return;
+	}
+	if ((w->enter != NULL && w->enter(w, n) == -1) ||
+	    scan_fd(&sc, dup(n->fd)) == -1) {
+		/* Its entries are left alone, so is it. */
+		close(n->fd);
+		n->fd = -1;
+		walk_fail(w);
+		walk_done(w, n);
+		return;
+	}
+	left = WALK_STEP;
+	while (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED) &&
+	    (name = scan_next(&sc, &type)) != NULL) {
+		if (type == DT_DIR ||
+		    (ret = w->leaf(w, n, name, type, &units)) == 1)
+			walk_push(w, n, name);
+		else if (ret == -1)
+			walk_fail(w);
+		if (--left == 0) {
+			left = WALK_STEP;
+			if (w->step != NULL && w->step(w, units))
+				walk_stop(w);
+			units = 0;
+		}
+	}
+	scan_close(&sc);
+	if (units && w->step != NULL && w->step(w, units))
+		walk_stop(w);
+	walk_done(w, n);
+}
+
+/* Walk directories until there are none left. */
+static void
+walk_run(struct walk *w)
+{
+	struct wnode *n;
+
+	pthread_mutex_lock(&w->mtx);
+	for (;;) {
+		while (w->nstack == 0 && w->busy > 0)
+			pthread_cond_wait(&w->cv, &w->mtx);
+		if (w->nstack == 0)
+			break;
+		n = w->stack[--w->nstack];
+		w->busy++;
+		pthread_mutex_unlock(&w->mtx);
+		if (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED) &&
+		    w->step != NULL && w->step(w, 0))
+			walk_stop(w);
+		if (__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+			walk_fail(w);
+			walk_done(w, n);
 		} else
-			ret |= proc(subpath);
+			walk_dir(w, n);
+		pthread_mutex_lock(&w->mtx);
+		w->busy--;
 	}
-	closedir(dp);
-	if (pos)
-		ret |= pos(path);
-	return ret;
+	/* Wake up the others: there's nothing left. */
+	pthread_cond_broadcast(&w->cv);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+/* Whether the walk is over. */
+static int
+walk_idle(struct walk *w)
+{
+	int idle;
+
+	pthread_mutex_lock(&w->mtx);
+	idle = w->nstack == 0 && w->busy == 0;
+	pthread_mutex_unlock(&w->mtx);
+	return idle;
+}
+
+static void *
+walk_thread(void *arg)
+{
+	walk_run(arg);
+	return NULL;
+}
+
+/*
+ * Walk w from n threads, the calling one included.  They're its own,
+ * so that a long walk doesn't hold the worker pool.
+ */
+static void
+walk_threads(struct walk *w, int n)
+{
+	pthread_t *threads;
+	int i;
+
+	threads = xcalloc(n, sizeof(*threads));
+	for (i = 1; i < n; i++)
+		if (pthread_create(&threads[i], NULL, walk_thread, w) != 0)
+			quit("pthread_create");
+	walk_run(w);
+	for (i = 1; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+/*
+ * A listing is built in three steps: the scan collects the names,
+ * with the type given by d_type when known (mode is 0 otherwise),
+ * then the entries that need it are stat'ed in parallel and finally
+ * the rows are filtered and sorted.
+ */
+struct statjob {
+	int dirfd;
+	struct rows *rows;
+	int first;
+};
+
+/* Get size and mode of some rows from job->first; mode is 0 on failure. */
+static void
+stat_rows(void *arg, size_t start, size_t end)
+{
+	struct statjob *job = arg;
+	struct rows *r = job->rows;
+	struct stat st;
+	const char *name;
+	size_t i;
+
+	for (i = job->first + start; i < job->first + end; i++) {
+		if (r->mode[i] != 0 && !S_ISREG(r->mode[i]) &&
+		    !S_ISLNK(r->mode[i]))
+			continue;
+		name = r->names.buf + r->name[i];
+		if (fstatat(job->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			r->mode[i] = 0;
+			continue;
+		}
+		if (S_ISLNK(st.st_mode)) {
+			r->flags[i] |= R_LINK;
+			/* Dangling links are shown as links. */
+			fstatat(job->dirfd, name, &st, 0);
+		}
+		r->size[i] = st.st_size;
+		r->mode[i] = st.st_mode;
+	}
+}
+
+/*
+ * Drop the rows from first to first + n hidden by flags and mark the
+ * directories with a '/'.  Return the number of rows left.
+ */
+static int
+filter_rows(struct rows *r, int first, int n, uint8_t flags)
+{
+	int i, j;
+
+	for (i = j = first; i < first + n; i++) {
+		if (r->mode[i] == 0 ||
+		    (S_ISDIR(r->mode[i]) && !(flags & SHOW_DIRS)) ||
+		    (!S_ISDIR(r->mode[i]) && !(flags & SHOW_FILES)))
+			continue;
+		if (S_ISDIR(r->mode[i])) {
+			r->size[i] = 0;
+			if (!(r->flags[i] & R_LINK))
+				strcat(r->names.buf + r->name[i], "/");
+		}
+		if (i != j)
+			rows_move(r, j, i, 1);
+		j++;
+	}
+	return j - first;
+}
+
+/*
+ * Directories are loaded in chunks of LOAD_CHUNK entries.  If the
+ * whole listing isn't ready after LOAD_DELAY milliseconds, the rows
+ * read so far are shown unsorted and the rest is loaded between key
+ * presses, redrawing every LOAD_DELAY milliseconds.  The final order
+ * replaces them at the end.
+ */
+#define LOAD_CHUNK  4096
+#define LOAD_DELAY  50
+
+/* Start loading the current working directory in fm.rows. */
+static int
+load_start(uint8_t flags)
+{
+	struct load *l = &fm.load;
+
+	if (scan_open(&l->sc, AT_FDCWD, ".") == -1)
+		return -1;
+	l->active = 1;
+	l->flags = flags;
+	l->center = 0;
+	l->sel[0] = '\0';
+	fm.nfiles = 0;
+	return 0;
+}
+
+/* Add the next chunk of entries to fm.rows.  Return 0 at the end. */
+static int
+load_step(void)
+{
+	struct load *l = &fm.load;
+	struct rows *r = &fm.rows;
+	struct statjob job;
+	const char *name;
+	size_t len;
+	int start, n, type;
+
+	start = n = fm.nfiles;
+	name = "";
+	while (n - start < LOAD_CHUNK &&
+	    (name = scan_next(&l->sc, &type)) != NULL) {
+		if (!(l->flags & SHOW_HIDDEN) && name[0] == '.')
+			continue;
+		if (type == DT_DIR ? !(l->flags & SHOW_DIRS) :
+		    type != DT_LNK && type != DT_UNKNOWN &&
+		    !(l->flags & SHOW_FILES))
+			continue;
+		rows_grow(r, n + 1);
+		/* Leave room for the '/' of directories. */
+		len = strlen(name);
+		r->name[n] = arena_alloc(&r->names, len + 2);
+		memcpy(r->names.buf + r->name[n], name, len + 1);
+		r->size[n] = 0;
+		r->mode[n] = type == DT_UNKNOWN ? 0 : DTTOIF(type);
+		r->flags[n] = 0;
+		n++;
+	}
+	job.dirfd = l->sc.fd;
+	job.rows = r;
+	job.first = start;
+	pool_run(stat_rows, &job, n - start, POOL_CHUNK);
+	n = filter_rows(r, start, n - start, l->flags);
+	key_rows(r, start, n);
+	fm.nfiles = start + n;
+	fm.version++;
+	return name != NULL;
+}
+
+/* Stop loading, leaving in fm.rows what was read so far. */
+static void
+load_abort(void)
+{
+	if (!fm.load.active)
+		return;
+	scan_close(&fm.load.sc);
+	fm.load.active = 0;
+	/* A partial listing can't be cached. */
+	fm.key.path[0] = '\0';
+}
+
+/* Select target once the listing is loaded, centering it if asked. */
+static void
+load_select(const char *target, int center)
+{
+	if (fm.load.active) {
+		strlcpy(fm.load.sel, target, sizeof(fm.load.sel));
+		fm.load.center = center;
+		return;
+	}
+	try_to_sel(target);
+	if (center && fm.nfiles > HEIGHT)
+		SCROLL = ESEL - HEIGHT / 2;
+}
+
+/* Whether the entry name of the current directory is marked. */
+static int
+is_marked(const char *name)
+{
+	struct mpath *dir;
+
+	if (fm.marks.nentries == 0 ||
+	    (dir = mark_dir(&fm.marks, CWD, 0)) == NULL)
+		return 0;
+	return is_mark(&fm.marks, dir, name);
+}
+
+/*
+ * Entry of the row i for the marks, with its directory in dir: the
+ * rows of a find are paths below CWD.
+ */
+static const char *
+row_entry(int i, char *dir, size_t len)
+{
+	const char *name, *p;
+
+	name = ENAME(i);
+	for (p = name + strlen(name) - 1; p > name && p[-1] != '/'; p--)
+		;
+	snprintf(dir, len, "%s%.*s", name[0] == '/' ? "" : CWD,
+	    (int)(p - name), name);
+	return p;
+}
+
+/* Restore the marks of the rows from first on. */
+static void
+mark_rows_from(int first)
+{
+	struct mpath *dir;
+	const char *entry;
+	char path[PATH_MAX];
+	int i;
+
+	if (fm.find[0] != '\0') {
+		for (i = first; i < fm.nfiles; i++) {
+			entry = row_entry(i, path, sizeof(path));
+			dir = NULL;
+			if (fm.marks.nentries != 0)
+				dir = mark_dir(&fm.marks, path, 0);
+			SETMARK(i, dir != NULL &&
+			    is_mark(&fm.marks, dir, entry));
+		}
+		return;
+	}
+	dir = NULL;
+	if (fm.marks.nentries != 0)
+		dir = mark_dir(&fm.marks, CWD, 0);
+	for (i = first; i < fm.nfiles; i++)
+		SETMARK(i, dir != NULL && is_mark(&fm.marks, dir, ENAME(i)));
+}
+
+/* Restore the marks of the entries in fm.rows. */
+static void
+mark_rows(void)
+{
+	mark_rows_from(0);
+}
+
+/* Sort the loaded rows, restore the marks and the selection. */
+static void
+load_finish(void)
+{
+	struct dirkey key;
+
+	key = fm.key;
+	load_abort();
+	fm.key = key;
+	if (fm.nfiles == 0) {
+		rows_free(&fm.rows);
+		return;
+	}
+	/* Keep the entry selected while loading, if any. */
+	if (fm.load.sel[0] == '\0' && ESEL > 0 && ESEL < fm.nfiles)
+		strlcpy(fm.load.sel, ENAME(ESEL), sizeof(fm.load.sel));
+	sort_rows(&fm.rows, fm.nfiles);
+	fm.version++;
+	mark_rows();
+	if (fm.load.sel[0] != '\0')
+		load_select(fm.load.sel, fm.load.center);
+}
+
+/* Go on loading for at most LOAD_DELAY milliseconds. */
+static void
+load_continue(void)
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (load_step())
+		if (elapsed_ms(&start) >= LOAD_DELAY)
+			return;
+	load_finish();
+}
+
+/* Called while waiting for input. */
+static void
+load_idle(void)
+{
+	if (!fm.load.active)
+		return;
+	load_continue();
+	if (fm.load.active)
+		message(CYAN, "Loading \"%s\"...", CWD);
+	else
+		clear_message();
+	update_view();
+}
+
+/*
+ * LRU cache of the listings of the directories recently visited.
+ * An entry is valid as long as its directory has the same device,
+ * inode, modification and change time, and shown with the same
+ * flags.  Listings are moved in and out of the cache, never copied.
+ */
+struct centry {
+	struct dirkey key;
+	struct rows rows;
+	int nfiles;
+	size_t mem;
+	struct centry *prev;
+	struct centry *next;
+};
+
+static struct cache {
+	struct centry *head;
+	struct centry *tail;
+	size_t mem;
+	int nentries;
+	unsigned long hits;
+	unsigned long misses;
+} cache;
+
+/* Fill key with the identity of the current working directory. */
+static int
+dirkey_get(struct dirkey *key, uint8_t flags)
+{
+	struct stat st;
+
+	if (stat(".", &st) == -1) {
+		key->path[0] = '\0';
+		return -1;
+	}
+	strlcpy(key->path, CWD, sizeof(key->path));
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->mtim = st.st_mtim;
+	key->ctim = st.st_ctim;
+	key->flags = flags;
+	return 0;
+}
+
+static int
+dirkey_eq(const struct dirkey *a, const struct dirkey *b)
+{
+	return a->dev == b->dev && a->ino == b->ino &&
+	    a->mtim.tv_sec == b->mtim.tv_sec &&
+	    a->mtim.tv_nsec == b->mtim.tv_nsec &&
+	    a->ctim.tv_sec == b->ctim.tv_sec &&
+	    a->ctim.tv_nsec == b->ctim.tv_nsec;
+}
+
+static void
+cache_unlink(struct centry *ce)
+{
+	if (ce->prev)
+		ce->prev->next = ce->next;
+	else
+		cache.head = ce->next;
+	if (ce->next)
+		ce->next->prev = ce->prev;
+	else
+		cache.tail = ce->prev;
+	cache.mem -= ce->mem;
+	cache.nentries--;
+}
+
+static void
+cache_drop(struct centry *ce)
+{
+	cache_unlink(ce);
+	rows_free(&ce->rows);
+	free(ce);
+}
+
+/* Give the listing of the directory key to the cache. */
+static void
+cache_put(const struct dirkey *key, struct rows *rows, int nfiles)
+{
+	struct centry *ce;
+	size_t mem;
+
+	mem = sizeof(*ce) + rows->nalloc * ROWSIZ + rows->names.size;
+	if (mem > RV_CACHE_SIZE) {
+		rows_free(rows);
+		return;
+	}
+	while (cache.tail && cache.mem + mem > RV_CACHE_SIZE)
+		cache_drop(cache.tail);
+	ce = xcalloc(1, sizeof(*ce));
+	ce->key = *key;
+	ce->rows = *rows;
+	ce->nfiles = nfiles;
+	ce->mem = mem;
+	ce->next = cache.head;
+	if (cache.head)
+		cache.head->prev = ce;
+	else
+		cache.tail = ce;
+	cache.head = ce;
+	cache.mem += mem;
+	cache.nentries++;
+	memset(rows, 0, sizeof(*rows));
+}
+
+/* Move the cached listing of the directory key, if valid, in fm.rows. */
+static int
+cache_take(const struct dirkey *key)
+{
+	struct centry *ce;
+
+	for (ce = cache.head; ce != NULL; ce = ce->next) {
+		if (ce->key.flags != key->flags ||
+		    strcmp(ce->key.path, key->path) != 0)
+			continue;
+		if (!dirkey_eq(&ce->key, key)) {
+			cache_drop(ce);
+			break;
+		}
+		cache_unlink(ce);
+		fm.rows = ce->rows;
+		fm.nfiles = ce->nfiles;
+		free(ce);
+		cache.hits++;
+		return 1;
+	}
+	cache.misses++;
+	return 0;
+}
+
+/* Forget the cached listings of path. */
+static void
+cache_forget(const char *path)
+{
+	struct centry *ce, *next;
+
+	for (ce = cache.head; ce != NULL; ce = next) {
+		next = ce->next;
+		if (!strcmp(ce->key.path, path))
+			cache_drop(ce);
+	}
+}
+
+static void
+cache_clear(void)
+{
+	while (cache.head)
+		cache_drop(cache.head);
+}
+
+/* Change working directory to the path in CWD. */
+static void
+cd(int reset)
+{
+	message(CYAN, "Loading \"%s\"...", CWD);
+	refresh();
+	load_abort();
+	find_stop();
+	if (chdir(CWD) == -1) {
+		getcwd(CWD, PATH_MAX - 1);
+		if (CWD[strlen(CWD) - 1] != '/')
+			strlcat(CWD, "/", sizeof(CWD));
+		goto done;
+	}
+	if (reset)
+		ESEL = SCROLL = 0;
+	if (fm.nfiles && fm.key.path[0] != '\0')
+		cache_put(&fm.key, &fm.rows, fm.nfiles);
+	else
+		rows_free(&fm.rows);
+	fm.nfiles = 0;
+	fm.version++;
+	if (dirkey_get(&fm.key, FLAGS) == 0 && cache_take(&fm.key))
+		mark_rows();
+	else if (load_start(FLAGS) == 0)
+		load_continue();
+	notify_sync();
+done:
+	if (!fm.load.active)
+		clear_message();
+	update_view();
+}
+
+/*
+ * Recursive find: the entries below CWD whose name matches a pattern,
+ * a glob(7) one if it has any of "*?[" or else a substring, are listed
+ * in place of CWD as they're found, named by their path from it.  The
+ * tree is walked by threads of their own, one per CPU, which hand the
+ * hits over in finder.hits; find_idle() moves them to fm.rows, sorted
+ * once the walk is over.  Hidden entries are skipped, hidden
+ * directories are not walked, unless shown.
+ *
+ * A grep is a find of the regular files containing a string, below
+ * CWD or among the marked entries, named by their absolute path if
+ * they're not below CWD.  Their size is replaced by the number of
+ * lines containing it.
+ */
+static struct finder {
+	struct walk	 walk;
+	pthread_mutex_t	 mtx;	/* Protects hits and running. */
+	struct rows	 hits;
+	int		 nhits;
+	int		 running;	/* Threads still walking. */
+	pthread_t	*threads;
+	int		 nthreads;
+	int		 glob;
+	uint8_t		 flags;
+	int		 esel;	/* Of CWD, restored by cmd_cd_up(). */
+	int		 scroll;
+	char		 root[PATH_MAX];	/* CWD, for the threads. */
+} finder;
+
+static int
+find_match(const char *name)
+{
+	if (finder.glob)
+		return fnmatch(fm.find, name, 0) == 0;
+	return strstr(name, fm.find) != NULL;
+}
+
+/*
+ * Files are searched GREP_CHUNK bytes at a time, so that a grep can be
+ * stopped in the middle of a large one, and are taken as binary, and
+ * skipped, if there's a NUL in their first GREP_PEEK bytes.
+ */
+#define GREP_CHUNK  (16 * 1024 * 1024)
+#define GREP_PEEK   8192
+
+/*
+ * First occurrence of n, of length len > 0, in the size bytes at h, or
+ * NULL.  The SSE2 version looks for the first and the last byte of n
+ * at 16 positions at once, comparing the rest only where both are.
+ */
+static const char *
+grep_find(const char *h, size_t size, const char *n, size_t len)
+{
+#ifdef GREP_SSE2
+	__m128i first, last, a, b;
+	unsigned int mask;
+	size_t i;
+
+	if (size < len)
+		return NULL;
+	first = _mm_set1_epi8(n[0]);
+	last = _mm_set1_epi8(n[len - 1]);
+	for (i = 0; i + len - 1 + 16 <= size; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(h + i));
+		b = _mm_loadu_si128((const __m128i *)(h + i + len - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		for (; mask != 0; mask &= mask - 1)
+			if (len <= 2 || !memcmp(h + i + __builtin_ctz(mask) + 1,
+			    n + 1, len - 2))
+				return h + i + __builtin_ctz(mask);
+	}
+	return memmem(h + i, size - i, n, len);
+#else
+	return memmem(h, size, n, len);
+#endif
+}
+
+/*
+ * Number of lines of the file name, of the given size, in dirfd,
+ * containing fm.find.  It's mapped rather than read, and left alone
+ * if it looks binary.
+ */
+static off_t
+grep_file(struct walk *w, int dirfd, const char *name, off_t size)
+{
+	const char *buf, *end, *p, *lim, *m;
+	size_t len;
+	off_t count;
+	int fd;
+
+	len = strlen(fm.find);
+	if (size < (off_t)len || (size_t)size != (uintmax_t)size ||
+	    (fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC)) == -1)
+		return 0;
+	buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return 0;
+	madvise((void *)buf, size, MADV_SEQUENTIAL);
+	end = buf + size;
+	count = 0;
+	if (memchr(buf, '\0', MIN(size, GREP_PEEK)) != NULL)
+		p = end;
+	else
+		p = buf;
+	while (p < end && !__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+		lim = end - p > GREP_CHUNK ? p + GREP_CHUNK + len - 1 : end;
+		if ((m = grep_find(p, lim - p, fm.find, len)) == NULL) {
+			if (lim == end)
+				break;
+			p = lim - (len - 1);
+			continue;
+		}
+		count++;
+		if ((p = memchr(m, '\n', end - m)) == NULL)
+			break;
+		p++;
+	}
+	munmap((void *)buf, size);
+	return count;
+}
+
+/* Name of the root path of a walk, in fm.rows. */
+static const char *
+find_root(const char *path)
+{
+	size_t len;
+
+	len = strlen(finder.root);
+	if (!strncmp(path, finder.root, len))
+		return path + len;
+	/* The root itself, without its '/'. */
+	if (!strncmp(path, finder.root, len - 1) && path[len - 1] == '\0')
+		return "";
+	return path;
+}
+
+/*
+ * Hand name, in dir, over to the main thread; st is its lstat(2), and
+ * count, if not -1, the number of lines grep_file() found.
+ */
+static void
+find_hit(struct wnode *dir, const char *name, struct stat *st,
+    off_t count)
+{
+	struct rows *r = &finder.hits;
+	struct wnode *n;
+	const char *s;
+	char path[PATH_MAX], *p;
+	size_t len;
+	uint8_t flags;
+	int i;
+
+	flags = count == -1 ? 0 : R_COUNT;
+	if (S_ISLNK(st->st_mode)) {
+		flags |= R_LINK;
+		/* Dangling links are shown as links. */
+		fstatat(dir->fd, name, st, 0);
+	}
+	if (S_ISDIR(st->st_mode) ? !(finder.flags & SHOW_DIRS) :
+	    !(finder.flags & SHOW_FILES))
+		return;
+	if (dir == NULL)
+		name = find_root(name);
+	/* The path is built backwards, up to the root. */
+	len = strlen(name) + (S_ISDIR(st->st_mode) && !(flags & R_LINK));
+	for (n = dir; n != NULL; n = n->parent) {
+		s = n->parent != NULL ? n->name : find_root(n->name);
+		len += strlen(s) + (*s != '\0');
+	}
+	if (len >= sizeof(path))
+		return;
+	p = path + len;
+	*p = '\0';
+	if (S_ISDIR(st->st_mode) && !(flags & R_LINK))
+		*--p = '/';
+	p -= strlen(name);
+	memcpy(p, name, strlen(name));
+	for (n = dir; n != NULL; n = n->parent) {
+		s = n->parent != NULL ? n->name : find_root(n->name);
+		if (*s == '\0')
+			continue;
+		*--p = '/';
+		p -= strlen(s);
+		memcpy(p, s, strlen(s));
+	}
+	pthread_mutex_lock(&finder.mtx);
+	i = finder.nhits++;
+	rows_grow(r, finder.nhits);
+	r->name[i] = arena_alloc(&r->names, len + 1);
+	memcpy(r->names.buf + r->name[i], path, len + 1);
+	if (count != -1)
+		r->size[i] = count;
+	else
+		r->size[i] = S_ISDIR(st->st_mode) ? 0 : st->st_size;
+	r->mode[i] = st->st_mode;
+	r->flags[i] = flags;
+	pthread_mutex_unlock(&finder.mtx);
+}
+
+static int
+find_enter(struct walk *w, struct wnode *n)
+{
+	struct stat st;
+
+	if (n->parent == NULL)
+		return 0;
+	/* Its entries are left alone. */
+	if (n->name[0] == '.' && !(finder.flags & SHOW_HIDDEN))
+		return -1;
+	if (!fm.grep && find_match(n->name) && fstat(n->fd, &st) == 0)
+		find_hit(n->parent, n->name, &st, -1);
+	return 0;
+}
+
+static int
+find_leaf(struct walk *w, struct wnode *dir, const char *name, int type,
+    off_t *units)
+{
+	struct stat st;
+	off_t count;
+	int dirfd;
+
+	/* Marked files are grepped, even hidden or through a link. */
+	if (dir == NULL) {
+		if (!fm.grep || stat(name, &st) == -1 ||
+		    !S_ISREG(st.st_mode))
+			return 0;
+		if ((count = grep_file(w, AT_FDCWD, name, st.st_size)) > 0)
+			find_hit(NULL, name, &st, count);
+		return 0;
+	}
+	if (name[0] == '.' && !(finder.flags & SHOW_HIDDEN))
+		return 0;
+	dirfd = dir->fd;
+	if (type == DT_UNKNOWN) {
+		if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+			return 0;
+		if (S_ISDIR(st.st_mode))
+			return 1;
+	}
+	if (fm.grep) {
+		if ((type != DT_REG && type != DT_UNKNOWN) ||
+		    (type == DT_REG &&
+		    fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) ||
+		    !S_ISREG(st.st_mode))
+			return 0;
+		if ((count = grep_file(w, dirfd, name, st.st_size)) > 0)
+			find_hit(dir, name, &st, count);
+		return 0;
+	}
+	if (!find_match(name) || (type != DT_UNKNOWN &&
+	    fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1))
+		return 0;
+	find_hit(dir, name, &st, -1);
+	return 0;
+}
+
+static void *
+find_thread(void *arg)
+{
+	walk_run(&finder.walk);
+	pthread_mutex_lock(&finder.mtx);
+	if (--finder.running == 0)
+		wake();
+	pthread_mutex_unlock(&finder.mtx);
+	return NULL;
+}
+
+/* Whether a find is walking the tree. */
+static int
+find_busy(void)
+{
+	return finder.threads != NULL;
+}
+
+/* Move the hits handed over so far to fm.rows, returning how many. */
+static int
+find_flush(void)
+{
+	struct rows *h = &finder.hits, *r = &fm.rows;
+	size_t len;
+	int i, j, n;
+
+	pthread_mutex_lock(&finder.mtx);
+	n = finder.nhits;
+	rows_grow(r, fm.nfiles + n);
+	for (i = 0, j = fm.nfiles; i < n; i++, j++) {
+		len = strlen(h->names.buf + h->name[i]) + 1;
+		r->name[j] = arena_alloc(&r->names, len);
+		memcpy(r->names.buf + r->name[j], h->names.buf + h->name[i],
+		    len);
+		r->size[j] = h->size[i];
+		r->mode[j] = h->mode[i];
+		r->flags[j] = h->flags[i];
+	}
+	finder.nhits = 0;
+	h->names.len = 0;
+	pthread_mutex_unlock(&finder.mtx);
+	fm.nfiles += n;
+	if (n) {
+		mark_rows_from(fm.nfiles - n);
+		fm.version++;
+	}
+	return n;
+}
+
+/* Stop the walk, if any, and wait for its threads. */
+static void
+find_join(void)
+{
+	int i;
+
+	if (finder.threads == NULL)
+		return;
+	walk_stop(&finder.walk);
+	for (i = 0; i < finder.nthreads; i++)
+		pthread_join(finder.threads[i], NULL);
+	free(finder.threads);
+	finder.threads = NULL;
+	walk_free(&finder.walk);
+}
+
+/* Stop the walk, keeping the hits found so far, and sort them. */
+static void
+find_finish(void)
+{
+	if (finder.threads == NULL)
+		return;
+	find_join();
+	find_flush();
+	rows_free(&finder.hits);
+	pthread_mutex_destroy(&finder.mtx);
+	if (fm.nfiles > 0) {
+		strlcpy(BUF2, ENAME(ESEL), BUFLEN);
+		key_rows(&fm.rows, 0, fm.nfiles);
+		sort_rows(&fm.rows, fm.nfiles);
+		fm.version++;
+		try_to_sel(BUF2);
+	}
+	clear_message();
+	message(CYAN, "Found %d entries.", fm.nfiles);
+}
+
+/* Leave the listing of the find, if any, to cd(). */
+static void
+find_stop(void)
+{
+	if (finder.threads != NULL) {
+		find_join();
+		rows_free(&finder.hits);
+		finder.nhits = 0;
+		pthread_mutex_destroy(&finder.mtx);
+	}
+	fm.find[0] = '\0';
+	fm.grep = 0;
+}
+
+/*
+ * List the entries below CWD matching pattern or, if grep, the files
+ * containing it below CWD or among the marked entries.
+ */
+static void
+find_start(const char *pattern, int grep)
+{
+	struct mpath *entry;
+	char path[PATH_MAX];
+	long ncpu;
+	int i;
+
+	load_abort();
+	if (fm.find[0] == '\0') {
+		finder.esel = ESEL;
+		finder.scroll = SCROLL;
+	}
+	/* The listing of CWD is kept for later. */
+	if (fm.nfiles && fm.key.path[0] != '\0')
+		cache_put(&fm.key, &fm.rows, fm.nfiles);
+	else
+		rows_free(&fm.rows);
+	find_stop();
+	strlcpy(fm.find, pattern, sizeof(fm.find));
+	fm.grep = grep;
+	fm.key.path[0] = '\0';
+	fm.nfiles = 0;
+	fm.version++;
+	ESEL = SCROLL = 0;
+	finder.glob = strpbrk(pattern, "*?[") != NULL;
+	finder.flags = FLAGS;
+	strlcpy(finder.root, CWD, sizeof(finder.root));
+	pthread_mutex_init(&finder.mtx, NULL);
+	walk_init(&finder.walk);
+	finder.walk.enter = find_enter;
+	finder.walk.leaf = find_leaf;
+	if (grep && fm.marks.nentries)
+		for (i = 0; (entry = next_mark(&fm.marks, &i)) != NULL; ) {
+			mark_path(entry, path, sizeof(path));
+			walk_push(&finder.walk, NULL, path);
+		}
+	else
+		walk_push(&finder.walk, NULL, finder.root);
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	finder.nthreads = MAX(MIN(ncpu, 64), 1);
+	finder.threads = xcalloc(finder.nthreads, sizeof(*finder.threads));
+	finder.running = finder.nthreads;
+	for (i = 0; i < finder.nthreads; i++)
+		if (pthread_create(&finder.threads[i], NULL, find_thread,
+		    NULL) != 0)
+			quit("pthread_create");
+	message(CYAN, "%s \"%s\"...", grep ? "Grepping" : "Finding",
+	    pattern);
+}
+
+/* Called while waiting for input. */
+static void
+find_idle(void)
+{
+	int running;
+
+	if (finder.threads == NULL)
+		return;
+	pthread_mutex_lock(&finder.mtx);
+	running = finder.running;
+	pthread_mutex_unlock(&finder.mtx);
+	if (!running)
+		find_finish();
+	else if (find_flush())
+		message(CYAN, "%s \"%s\"... %d found.",
+		    fm.grep ? "Grepping" : "Finding", fm.find, fm.nfiles);
+	else
+		return;
+	update_view();
+}
+
+/* Select a target entry, if it is present. */
+static void
+try_to_sel(const char *target)
+{
+	ESEL = 0;
+	if (!ISDIR(target))
+		while ((ESEL + 1) < fm.nfiles && S_ISDIR(EMODE(ESEL)))
+			ESEL++;
+	while ((ESEL + 1) < fm.nfiles && strcoll(ENAME(ESEL), target) < 0)
+		ESEL++;
+}
+
+/* Reload CWD, but try to keep selection. */
+static void
+reload()
+{
+	if (fm.find[0] != '\0') {
+		/* Find again. */
+		strlcpy(INPUT, fm.find, sizeof(INPUT));
+		find_start(INPUT, fm.grep);
+		update_view();
+	} else if (fm.nfiles) {
+		strlcpy(INPUT, ENAME(ESEL), sizeof(INPUT));
+		/* Drop the listing so that it's read again. */
+		rows_free(&fm.rows);
+		fm.nfiles = 0;
+		cd(0);
+		load_select(INPUT, 0);
+		update_view();
+	} else
+		cd(1);
+}
+
+/*
+ * Keep the listings up to date with inotify(7).  The directories of
+ * all the tabs are watched: changes to the current one are applied
+ * to fm.rows one entry at a time, while those to the others just
+ * drop their cached listing.  Events received while a directory is
+ * being loaded are ignored, as the scan will likely see them.
+ */
+#ifdef __linux__
+#define NOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		    IN_MODIFY | IN_ATTRIB | IN_ONLYDIR)
+#define NOTIFY_BUFSIZ   (64 * 1024)
+
+static struct watch {
+	int wd;
+	char path[PATH_MAX];
+} watches[nitems(fm.tabs)];
+
+static void
+notify_init(void)
+{
+	size_t i;
+
+	fm.notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	for (i = 0; i < nitems(watches); i++)
+		watches[i].wd = -1;
+}
+
+/* Watch the directories of the tabs, and only them. */
+static void
+notify_sync(void)
+{
+	size_t i, j;
+	int wd;
+
+	if (fm.notify == -1)
+		return;
+	for (i = 0; i < nitems(watches); i++) {
+		if (watches[i].wd == -1 ||
+		    !strcmp(watches[i].path, fm.tabs[i].cwd))
+			continue;
+		wd = watches[i].wd;
+		watches[i].wd = -1;
+		for (j = 0; j < nitems(watches); j++)
+			if (watches[j].wd == wd)
+				break;
+		if (j == nitems(watches))
+			inotify_rm_watch(fm.notify, wd);
+	}
+	for (i = 0; i < nitems(watches); i++) {
+		if (watches[i].wd != -1)
+			continue;
+		strlcpy(watches[i].path, fm.tabs[i].cwd,
+		    sizeof(watches[i].path));
+		watches[i].wd = inotify_add_watch(fm.notify, watches[i].path,
+		    NOTIFY_MASK);
+	}
+}
+
+/*
+ * Index of the first row not less than a row with the given mode and
+ * key: directories come first, then the keys are in strcmp(3) order.
+ */
+static int
+row_lower(mode_t mode, uint32_t key)
+{
+	const char *base = fm.rows.names.buf;
+	int lo, hi, mid, cmp;
+
+	lo = 0;
+	hi = fm.nfiles;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = S_ISDIR(mode) - S_ISDIR(EMODE(mid));
+		if (cmp == 0)
+			cmp = strcmp(base + fm.rows.key[mid], base + key);
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Index of the row with the given name and mode, or -1. */
+static int
+probe_row(const char *name, mode_t mode)
+{
+	struct arena *a = &fm.rows.names;
+	uint32_t off;
+	size_t len;
+	int i;
+
+	/* The probe is stored past the end of the names, then dropped. */
+	len = a->len;
+	off = arena_alloc(a, strlen(name) + 1);
+	strcpy(a->buf + off, name);
+	i = row_lower(mode, arena_key(a, off));
+	a->len = len;
+	if (i < fm.nfiles && !strcmp(ENAME(i), name))
+		return i;
+	return -1;
+}
+
+/* Find the row of the entry name, or -1. */
+static int
+find_row(const char *name)
+{
+	char path[PATH_MAX];
+	int i;
+
+	/* Directories, links to directories and then the rest. */
+	snprintf(path, sizeof(path), "%s/", name);
+	if ((i = probe_row(path, S_IFDIR)) != -1 ||
+	    (i = probe_row(name, S_IFDIR)) != -1)
+		return i;
+	return probe_row(name, S_IFREG);
+}
+
+static void
+del_row(int i)
+{
+	fm.nfiles--;
+	fm.version++;
+	rows_move(&fm.rows, i, i + 1, fm.nfiles - i);
+	if (i < ESEL || (ESEL == fm.nfiles && ESEL > 0))
+		ESEL--;
+}
+
+/* (Re)read the entry name and put it at its place in fm.rows. */
+static void
+update_row(const char *name)
+{
+	struct rows *r = &fm.rows;
+	struct statjob job;
+	uint32_t nameoff, key;
+	off_t size;
+	mode_t mode;
+	uint8_t flags;
+	size_t len;
+	int i, n, sel;
+
+	sel = 0;
+	if ((i = find_row(name)) != -1) {
+		/* The selection stays on the entry re-read. */
+		sel = i == ESEL;
+		del_row(i);
+	}
+	if (!(FLAGS & SHOW_HIDDEN) && name[0] == '.')
+		return;
+	/* Read it past the last row, then move it in place. */
+	n = fm.nfiles;
+	rows_grow(r, n + 1);
+	len = r->names.len;
+	r->name[n] = arena_alloc(&r->names, strlen(name) + 2);
+	strcpy(r->names.buf + r->name[n], name);
+	r->mode[n] = 0;
+	r->flags[n] = 0;
+	job.dirfd = AT_FDCWD;
+	job.rows = r;
+	job.first = n;
+	stat_rows(&job, 0, 1);
+	if (filter_rows(r, n, 1, FLAGS) == 0) {
+		r->names.len = len;
+		return;
+	}
+	nameoff = r->name[n];
+	key = arena_key(&r->names, nameoff);
+	size = r->size[n];
+	mode = r->mode[n];
+	flags = r->flags[n];
+	if (is_marked(r->names.buf + nameoff))
+		flags |= R_MARKED;
+	i = row_lower(mode, key);
+	rows_move(r, i + 1, i, n - i);
+	r->name[i] = nameoff;
+	r->key[i] = key;
+	r->size[i] = size;
+	r->mode[i] = mode;
+	r->flags[i] = flags;
+	fm.nfiles++;
+	fm.version++;
+	if (sel)
+		ESEL = i;
+	else if (i <= ESEL && fm.nfiles > 1)
+		ESEL++;
+}
+
+/* Apply the pending events, if any. */
+static void
+notify_idle(void)
+{
+	static char buf[NOTIFY_BUFSIZ]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct dirkey key;
+	ssize_t r;
+	size_t i;
+	char *p;
+	int changed = 0;
+
+	if (fm.notify == -1 || (r = read(fm.notify, buf, sizeof(buf))) <= 0)
+		return;
+	/*
+	 * Taken before the rest of the queue is read: whatever changed
+	 * earlier is applied below, a change made meanwhile makes the
+	 * cached listing out of date rather than passing for applied.
+	 */
+	key = fm.key;
+	if (key.path[0] != '\0')
+		dirkey_get(&key, FLAGS);
+	do {
+		for (p = buf; p < buf + r; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				cache_clear();
+				changed = -1;
+				continue;
+			}
+			for (i = 0; i < nitems(watches); i++)
+				if (watches[i].wd == ev->wd)
+					break;
+			if (i == nitems(watches) || ev->len == 0)
+				continue;
+			if (strcmp(watches[i].path, CWD) != 0) {
+				cache_forget(watches[i].path);
+				continue;
+			}
+			if (fm.load.active || fm.find[0] != '\0' ||
+			    changed == -1)
+				continue;
+			update_row(ev->name);
+			changed = 1;
+		}
+	} while ((r = read(fm.notify, buf, sizeof(buf))) > 0);
+	if (changed == -1) {
+		reload();
+		return;
+	}
+	if (!changed)
+		return;
+	/* The listing now matches the directory as it was. */
+	if (fm.key.path[0] != '\0')
+		fm.key = key;
+	rows_compact(&fm.rows, fm.nfiles);
+	update_view();
+}
+#else
+static void
+notify_init(void)
+{
+	fm.notify = -1;
+}
+
+static void
+notify_sync(void)
+{
+}
+
+static void
+notify_idle(void)
+{
+}
+#endif
+
+/* Work done while waiting for user input. */
+static void
+idle(void)
+{
+	sync_signals();
+	load_idle();
+	find_idle();
+	notify_idle();
+	jobs_idle();
+}
+
+/*
+ * Copies, moves and deletions of the marked entries are queued as
+ * jobs, run one after the other by a thread of their own while the
+ * user goes on browsing.  jobs.mtx protects the list and the progress
+ * of the jobs; jobs.cur, the running job, is only changed by that
+ * thread, so the functions called from it may use it freely.
+ */
+#define JOBS_KEEP   16	/* Finished jobs kept in the list. */
+
+static struct jobs {
+	pthread_mutex_t	 mtx;
+	pthread_cond_t	 cv;
+	pthread_t	 thread;
+	int		 quit;
+	int		 lastid;
+	struct job	*head;		/* Oldest first. */
+	struct job	*cur;
+	int		 viewing;	/* In cmd_jobs(). */
+	char		 shown[16];	/* Progress on the top line. */
+} jobs;
+
+/*
+ * Wait while the running job is paused; return whether it was
+ * cancelled.  Called before each step of the job.
+ */
+static int
+job_check(void)
+{
+	int cancel;
+
+	pthread_mutex_lock(&jobs.mtx);
+	while (jobs.cur->paused && !jobs.cur->cancel)
+		pthread_cond_wait(&jobs.cv, &jobs.mtx);
+	cancel = jobs.cur->cancel;
+	pthread_mutex_unlock(&jobs.mtx);
+	return cancel;
+}
+
+/* Add delta to the progress; may be called from the worker pool. */
+static void
+update_progress(off_t delta)
+{
+	pthread_mutex_lock(&jobs.mtx);
+	jobs.cur->partial += delta;
+	pthread_mutex_unlock(&jobs.mtx);
+}
+
+/*
+ * The size of the marked entries is counted in the background, while
+ * they're processed, so that the job doesn't wait for it: its total
+ * grows as the count goes on.  The threads of the count share a walk
+ * of the entries, so that a large subtree is counted by all of them.
+ * Files with more than one link are counted once.
+ * Deletions, which don't need the sizes, count the entries instead,
+ * without stat(2) when d_type tells the directories apart.
+ */
+struct inode {
+	dev_t dev;
+	ino_t ino;
+};
+
+static struct count {
+	pthread_mutex_t	 mtx;
+	pthread_t	*threads;
+	int		 nthreads;
+	int		 entries;	/* Count entries, not bytes. */
+	struct inode	*seen;		/* Hash set; ino 0 is free. */
+	size_t		 nseen;
+	size_t		 size;
+} count = {
+	PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0, 0
+};
+
+static struct walk count_walk;
+
+static void
+count_add(off_t n)
+{
+	if (n == 0)
+		return;
+	pthread_mutex_lock(&jobs.mtx);
+	jobs.cur->total += n;
+	pthread_mutex_unlock(&jobs.mtx);
+}
+
+/* Whether the inode was seen already; called with count.mtx held. */
+static int
+count_seen(dev_t dev, ino_t ino)
+{
+	struct inode *old;
+	size_t i, mask, oldsize;
+
+	if ((count.nseen + 1) * 2 > count.size) {
+		old = count.seen;
+		oldsize = count.size;
+		count.size = count.size ? count.size * 2 : 1024;
+		count.seen = xcalloc(count.size, sizeof(*count.seen));
+		count.nseen = 0;
+		for (i = 0; i < oldsize; i++)
+			if (old[i].ino != 0)
+				count_seen(old[i].dev, old[i].ino);
+		free(old);
+	}
+	mask = count.size - 1;
+	for (i = (ino * 0x9e3779b97f4a7c15ULL ^ dev) & mask;
+	    count.seen[i].ino != 0; i = (i + 1) & mask)
+		if (count.seen[i].ino == ino && count.seen[i].dev == dev)
+			return 1;
+	count.seen[i].dev = dev;
+	count.seen[i].ino = ino;
+	count.nseen++;
+	return 0;
+}
+
+/* Size of an entry, or 0 if it's a hard link already counted. */
+static off_t
+count_size(const struct stat *st)
+{
+	int seen;
+
+	if (st->st_nlink < 2 || S_ISDIR(st->st_mode))
+		return st->st_size;
+	pthread_mutex_lock(&count.mtx);
+	seen = count_seen(st->st_dev, st->st_ino);
+	pthread_mutex_unlock(&count.mtx);
+	return seen ? 0 : st->st_size;
+}
+
+static int
+count_enter(struct walk *w, struct wnode *n)
+{
+	/* The directory itself is an entry. */
+	if (count.entries)
+		count_add(1);
+	return 0;
+}
+
+static int
+count_leaf(struct walk *w, struct wnode *dir, const char *name, int type,
+    off_t *units)
+{
+	struct stat st;
+
+	if (count.entries && type != DT_UNKNOWN) {
+		(*units)++;
+		return 0;
+	}
+	if (fstatat(dir ? dir->fd : AT_FDCWD, name, &st,
+	    AT_SYMLINK_NOFOLLOW) == -1)
+		return 0;
+	if (S_ISDIR(st.st_mode))
+		return 1;
+	*units += count.entries ? 1 : count_size(&st);
+	return 0;
+}
+
+static int
+count_step(struct walk *w, off_t units)
+{
+	count_add(units);
+	return 0;
+}
+
+static void *
+count_worker(void *arg)
+{
+	walk_run(&count_walk);
+	return NULL;
+}
+
+/* Start counting the entries of job j in its total. */
+static void
+count_start(struct job *j)
+{
+	int i;
+
+	count.entries = j->op == JOB_DELETE;
+	walk_init(&count_walk);
+	count_walk.enter = count_enter;
+	count_walk.leaf = count_leaf;
+	count_walk.leave = NULL;
+	count_walk.step = count_step;
+	for (i = 0; i < j->nsrc; i++)
+		walk_push(&count_walk, NULL, j->src[i]);
+	pthread_mutex_lock(&count.mtx);
+	count.nthreads = pool.nthreads + 1;
+	count.threads = xcalloc(count.nthreads, sizeof(*count.threads));
+	for (i = 0; i < count.nthreads; i++)
+		if (pthread_create(&count.threads[i], NULL, count_worker,
+		    NULL) != 0)
+			quit("pthread_create");
+	pthread_mutex_unlock(&count.mtx);
+}
+
+/* Whether the count is over. */
+static int
+count_done(void)
+{
+	int done;
+
+	/* The walk only exists while there are threads. */
+	pthread_mutex_lock(&count.mtx);
+	done = count.nthreads == 0 || walk_idle(&count_walk);
+	pthread_mutex_unlock(&count.mtx);
+	return done;
+}
+
+/* Stop the count, if it's still going on. */
+static void
+count_stop(void)
+{
+	int i;
+
+	walk_stop(&count_walk);
+	for (i = 0; i < count.nthreads; i++)
+		pthread_join(count.threads[i], NULL);
+	pthread_mutex_lock(&count.mtx);
+	free(count.threads);
+	count.threads = NULL;
+	count.nthreads = 0;
+	walk_free(&count_walk);
+	pthread_mutex_unlock(&count.mtx);
+	free(count.seen);
+	count.seen = NULL;
+	count.nseen = count.size = 0;
+}
+
+/* Wrappers for file operations. */
+static int
+addfile(const char *path)
+{
+	/* Using creat(2) because mknod(2) doesn't seem to be portable. */
+	int ret;
+
+	ret = creat(path, 0644);
+	if (ret < 0)
+		return ret;
+	return close(ret);
+}
+
+#ifdef RV_JOURNAL
+/*
+ * Journal of a copy or a move, so that it can be resumed once
+ * interrupted: a header with the operation, the destination and the
+ * sources, each NUL-terminated, then a struct jrec per file copied and,
+ * every JOURNAL_STEP bytes, one with the offset reached in the file
+ * being copied.  A file is known by the device and inode of its
+ * directory, its name, inode, size and modification time, hashed in a
+ * 64 bits key, so that a file changed since is copied again.
+ *
+ * The journals live in RV_JOURNAL, under $HOME, and are locked with
+ * flock(2) while in use.  A job over removes its journal, unless fm is
+ * quitting; journals_load() finds the others, of jobs interrupted,
+ * when fm starts.  Records are buffered, so a few small files may be
+ * copied again.
+ */
+#define JOURNAL_NBUF  256
+#define JOURNAL_MAGIC "fm journal 1"
+
+struct jrec {
+	uint64_t key;
+	int64_t off;		/* -1 once copied. */
+};
+
+struct journal {
+	pthread_mutex_t mtx;
+	int fd;
+	char path[PATH_MAX];
+	struct jrec buf[JOURNAL_NBUF];
+	int nbuf;
+	struct jrec *recs;	/* Of the previous runs, by key. */
+	size_t mask;
+};
+
+/* FNV-1a of the len bytes at p, seeded with h. */
+static uint64_t
+journal_hash(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *s = p;
+
+	while (len--)
+		h = (h ^ *s++) * 1099511628211u;
+	return h;
+}
+
+/* Key of a directory, from its stat(2). */
+static uint64_t
+journal_dir(const struct stat *st)
+{
+	uint64_t h = 14695981039346656037u;
+
+	h = journal_hash(h, &st->st_dev, sizeof(st->st_dev));
+	return journal_hash(h, &st->st_ino, sizeof(st->st_ino));
+}
+
+/* Key of file name, described by st, in directory dir. */
+static uint64_t
+journal_file(uint64_t dir, const char *name, const struct stat *st)
+{
+	uint64_t h;
+
+	h = journal_hash(dir, name, strlen(name) + 1);
+	h = journal_hash(h, &st->st_ino, sizeof(st->st_ino));
+	h = journal_hash(h, &st->st_size, sizeof(st->st_size));
+	h = journal_hash(h, &st->st_mtim, sizeof(st->st_mtim));
+	return h ? h : 1;	/* 0 is a free slot. */
+}
+
+/* Where the copy of file key got to: 0 if unknown, -1 if it's done. */
+static off_t
+journal_get(struct journal *jn, uint64_t key)
+{
+	size_t i;
+
+	if (jn == NULL || jn->recs == NULL)
+		return 0;
+	for (i = key & jn->mask; jn->recs[i].key; i = (i + 1) & jn->mask)
+		if (jn->recs[i].key == key)
+			return jn->recs[i].off;
+	return 0;
+}
+
+static void
+journal_flush(struct journal *jn)
+{
+	if (jn->nbuf > 0 && jn->fd != -1)
+		write(jn->fd, jn->buf, jn->nbuf * sizeof(*jn->buf));
+	jn->nbuf = 0;
+}
+
+/* Record that file key is copied up to off, or -1 once done. */
+static void
+journal_put(struct journal *jn, uint64_t key, off_t off)
+{
+	if (jn == NULL)
+		return;
+	pthread_mutex_lock(&jn->mtx);
+	jn->buf[jn->nbuf].key = key;
+	jn->buf[jn->nbuf++].off = off;
+	/* The checkpoints of large files are worth a write. */
+	if (jn->nbuf == JOURNAL_NBUF || off != -1)
+		journal_flush(jn);
+	pthread_mutex_unlock(&jn->mtx);
+}
+
+/* Index the n records at p. */
+static void
+journal_index(struct journal *jn, const char *p, size_t n)
+{
+	struct jrec r, *slot;
+	size_t i, size;
+
+	if (n == 0)
+		return;
+	for (size = 64; size < n * 2; size *= 2)
+		;
+	jn->recs = xcalloc(size, sizeof(*jn->recs));
+	jn->mask = size - 1;
+	for (; n > 0; n--, p += sizeof(r)) {
+		memcpy(&r, p, sizeof(r));
+		for (i = r.key & jn->mask; jn->recs[i].key &&
+		    jn->recs[i].key != r.key; i = (i + 1) & jn->mask)
+			;
+		slot = &jn->recs[i];
+		if (slot->key == 0 || r.off == -1 ||
+		    (slot->off != -1 && r.off > slot->off))
+			*slot = r;
+	}
+}
+
+static struct journal *
+journal_new(int fd, const char *path)
+{
+	struct journal *jn;
+
+	jn = xcalloc(1, sizeof(*jn));
+	pthread_mutex_init(&jn->mtx, NULL);
+	jn->fd = fd;
+	strlcpy(jn->path, path, sizeof(jn->path));
+	return jn;
+}
+
+/* Path of the directory of the journals, created if missing. */
+static int
+journal_path(char *path, size_t len)
+{
+	const char *home;
+	char *p;
+
+	if ((home = getenv("HOME")) == NULL ||
+	    snprintf(path, len, "%s/%s", home, RV_JOURNAL) >= (int)len)
+		return -1;
+	for (p = path + strlen(home) + 1; (p = strchr(p, '/')) != NULL;
+	    p++) {
+		*p = '\0';
+		if (mkdir(path, 0700) == -1 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+/* Start the journal of job j; it goes on without one on error. */
+static void
+journal_create(struct job *j)
+{
+	char path[PATH_MAX], op[16], *hdr;
+	size_t len, size;
+	int fd, i;
+
+	if (journal_path(path, sizeof(path)) == -1 ||
+	    strlcat(path, "/job.XXXXXX", sizeof(path)) >= sizeof(path) ||
+	    (fd = mkstemp(path)) == -1)
+		return;
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		unlink(path);
+		return;
+	}
+	snprintf(op, sizeof(op), "%s%s", job_name(j->op),
+	    j->verify ? "+verify" : "");
+	size = sizeof(JOURNAL_MAGIC) + strlen(op) + 1 + strlen(j->dst) + 2;
+	for (i = 0; i < j->nsrc; i++)
+		size += strlen(j->src[i]) + 1;
+	hdr = xcalloc(1, size);
+	len = 0;
+	memcpy(hdr, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	len += sizeof(JOURNAL_MAGIC);
+	len += strlcpy(hdr + len, op, size - len) + 1;
+	len += strlcpy(hdr + len, j->dst, size - len) + 1;
+	for (i = 0; i < j->nsrc; i++)
+		len += strlcpy(hdr + len, j->src[i], size - len) + 1;
+	/* The sources end with an empty string. */
+	if (write(fd, hdr, size) != (ssize_t)size) {
+		close(fd);
+		unlink(path);
+	} else {
+		fcntl(fd, F_SETFL, O_APPEND);
+		j->journal = journal_new(fd, path);
+	}
+	free(hdr);
+}
+
+/* Done with the journal of j, which is removed if the job is over. */
+static void
+journal_close(struct job *j, int remove)
+{
+	struct journal *jn = j->journal;
+
+	if (jn == NULL)
+		return;
+	journal_flush(jn);
+	if (remove)
+		unlink(jn->path);
+	close(jn->fd);
+	pthread_mutex_destroy(&jn->mtx);
+	free(jn->recs);
+	free(jn);
+	j->journal = NULL;
+}
+
+/* Read the job of journal path, unless another fm has it. */
+static struct job *
+journal_load(const char *path)
+{
+	struct job *j;
+	struct stat st;
+	char *buf, *op, *p, *end;
+	ssize_t n;
+	size_t len;
+	int fd, i;
+
+	if ((fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC)) == -1)
+		return NULL;
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	buf = xcalloc(1, st.st_size + 1);
+	for (len = 0; len < (size_t)st.st_size; len += n)
+		if ((n = read(fd, buf + len, st.st_size - len)) <= 0)
+			break;
+	end = buf + len;
+	j = xcalloc(1, sizeof(*j));
+	if (len < sizeof(JOURNAL_MAGIC) || strcmp(buf, JOURNAL_MAGIC))
+		goto bad;
+	op = buf + sizeof(JOURNAL_MAGIC);
+	if ((p = op + strlen(op) + 1) >= end)
+		goto bad;
+	j->op = !strncmp(op, "move", 4) ? JOB_MOVE : JOB_COPY;
+	j->verify = strstr(op, "+verify") != NULL;
+	if (strlcpy(j->dst, p, sizeof(j->dst)) >= sizeof(j->dst) ||
+	    (p += strlen(p) + 1) >= end)
+		goto bad;
+	for (i = 0; p < end && *p != '\0'; i++, p += strlen(p) + 1) {
+		j->src = xrealloc(j->src, (i + 1) * sizeof(*j->src));
+		j->src[i] = xstrdup(p);
+		j->nsrc = i + 1;
+	}
+	if (p >= end || j->nsrc == 0)
+		goto bad;
+	p++;
+	j->result = xcalloc(j->nsrc, sizeof(*j->result));
+	for (i = 0; i < j->nsrc; i++)
+		j->result[i] = 1;
+	j->state = JOB_INTERRUPTED;
+	j->journal = journal_new(fd, path);
+	/* A record cut short by a crash is left out. */
+	journal_index(j->journal, p, (end - p) / sizeof(struct jrec));
+	free(buf);
+	return j;
+bad:
+	for (i = 0; i < j->nsrc; i++)
+		free(j->src[i]);
+	free(j->src);
+	free(j);
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+/* Queue the jobs interrupted, as such; return their number. */
+static int
+journals_load(void)
+{
+	struct job *j, **tail;
+	struct dirent *de;
+	DIR *d;
+	char path[PATH_MAX], file[PATH_MAX];
+	int n;
+
+	if (journal_path(path, sizeof(path)) == -1 ||
+	    (d = opendir(path)) == NULL)
+		return 0;
+	n = 0;
+	pthread_mutex_lock(&jobs.mtx);
+	for (tail = &jobs.head; *tail != NULL; tail = &(*tail)->next)
+		;
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, "job.", 4) ||
+		    snprintf(file, sizeof(file), "%s/%s", path, de->d_name) >=
+		    (int)sizeof(file) || (j = journal_load(file)) == NULL)
+			continue;
+		j->id = ++jobs.lastid;
+		*tail = j;
+		tail = &j->next;
+		n++;
+	}
+	pthread_mutex_unlock(&jobs.mtx);
+	closedir(d);
+	return n;
+}
+#else
+static off_t
+journal_get(struct journal *jn, uint64_t key)
+{
+	return 0;
+}
+
+static void
+journal_put(struct journal *jn, uint64_t key, off_t off)
+{
+}
+
+static uint64_t
+journal_dir(const struct stat *st)
+{
+	return 0;
+}
+
+static uint64_t
+journal_file(uint64_t dir, const char *name, const struct stat *st)
+{
+	return 0;
+}
+
+static void
+journal_create(struct job *j)
+{
+}
+
+static void
+journal_close(struct job *j, int remove)
+{
+}
+
+static int
+journals_load(void)
+{
+	return 0;
+}
+#endif
+
+/*
+ * File data is copied by the kernel when possible: with a reflink,
+ * which shares the extents on file systems that support it, then with
+ * copy_file_range(2) and sendfile(2).  Otherwise, and on other
+ * systems, it goes through a buffer of up to COPY_BUFSIZ bytes.
+ * Progress is reported every PROG_STEP bytes.  A file is copied from
+ * offset off, of both files, which is journaled every JOURNAL_STEP
+ * bytes.
+ */
+#define COPY_BUFSIZ  (1024 * 1024)
+#define PROG_STEP    (1024 * 1024)
+#define JOURNAL_STEP (64 * 1024 * 1024)
+
+struct cfile {
+	int src;
+	int dst;
+	off_t off;
+	off_t size;
+	off_t saved;		/* Offset journaled last. */
+	off_t pending;		/* Progress not reported yet. */
+	struct journal *journal;
+	uint64_t key;
+	char *verify;		/* Path of dst, if it's to be verified. */
+};
+
+/* Return whether the job was cancelled. */
+static int
+copy_progress(off_t *pending, off_t n, int flush)
+{
+	*pending += n;
+	if (*pending >= PROG_STEP || (flush && *pending > 0)) {
+		update_progress(*pending);
+		*pending = 0;
+		return job_check();
+	}
+	return 0;
+}
+
+/* Account for n bytes of f copied; return whether it was cancelled. */
+static int
+copy_advance(struct cfile *f, off_t n)
+{
+	f->off += n;
+	if (f->journal != NULL && f->off - f->saved >= JOURNAL_STEP) {
+		journal_put(f->journal, f->key, f->off);
+		f->saved = f->off;
+	}
+	return copy_progress(&f->pending, n, 0);
+}
+
+#ifdef __linux__
+/*
+ * Copy from src to dst with copy_file_range(2), or sendfile(2).
+ * Return 0 at the end, -1 on error and 1 if the rest must be copied
+ * another way.  Both file offsets are advanced, so that it can.
+ */
+static int
+copy_range(struct cfile *f, int use_sendfile)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (use_sendfile)
+			n = sendfile(f->dst, f->src, NULL, COPY_BUFSIZ);
+		else
+			n = copy_file_range(f->src, NULL, f->dst, NULL,
+			    COPY_BUFSIZ, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS || errno == EXDEV ||
+			    errno == EINVAL || errno == EOPNOTSUPP ||
+			    errno == EBADF)
+				return 1;
+			return -1;
+		}
+		/* Some file systems don't report their files' size. */
+		if (n == 0)
+			return f->off < f->size ? 1 : 0;
+		if (copy_advance(f, n))
+			return -1;
+	}
+}
+#endif
+
+/* Copy the rest of f through a buffer. */
+static int
+copy_buffer(struct cfile *f)
+{
+	char *buf;
+	size_t bufsiz;
+	ssize_t n, w, off;
+	int ret;
+
+	bufsiz = MIN(MAX(f->size - f->off, BUFSIZ), COPY_BUFSIZ);
+	buf = xcalloc(1, bufsiz);
+	ret = 0;
+	while ((n = read(f->src, buf, bufsiz)) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+		for (off = 0; off < n; off += w)
+			if ((w = write(f->dst, buf + off, n - off)) == -1) {
+				if (errno != EINTR) {
+					ret = -1;
+					goto done;
+				}
+				w = 0;
+			}
+		if (copy_advance(f, n)) {
+			ret = -1;
+			break;
+		}
+	}
+done:
+	free(buf);
+	return ret;
+}
+
+/* Copy the data of f, whose files are at offset f->off. */
+static int
+copy_data(struct cfile *f)
+{
+	int ret;
+
+	ret = 1;
+#ifdef __linux__
+	if (f->size > 0) {
+#ifdef FICLONE
+		if (ioctl(f->dst, FICLONE, f->src) == 0) {
+			copy_progress(&f->pending, f->size - f->off, 1);
+			return 0;
+		}
+#endif
+		ret = copy_range(f, 0);
+		if (ret == 1)
+			ret = copy_range(f, 1);
+	}
+#endif
+	if (ret == 1)
+		ret = copy_buffer(f);
+	copy_progress(&f->pending, 0, 1);
+	return ret;
+}
+
+/*
+ * Verification of the copies, when enabled with cmd_verify(): the
+ * files copied are handed to VERIFY_THREADS threads, so that the copy
+ * goes on meanwhile, which flush the copy to the device and drop it
+ * from the page cache, then compare the CRC-32C of both files.  Those
+ * which differ, or can't be read back, are kept in the mismatch list
+ * of the job, and marked once it's over.  Moves are verified before
+ * their source is deleted, from the thread of the walk.
+ */
+#define VERIFY_THREADS 4
+#define VERIFY_QUEUE   64
+#define VERIFY_BUFSIZ  (1024 * 1024)
+
+static struct verify {
+	pthread_mutex_t	 mtx;
+	pthread_cond_t	 cv;
+	pthread_t	 threads[VERIFY_THREADS];
+	int		 nthreads;
+	int		 quit;
+	struct cfile	 queue[VERIFY_QUEUE];
+	int		 head;
+	int		 n;
+} verify = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.cv = PTHREAD_COND_INITIALIZER
+};
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c)(uint32_t, const unsigned char *, size_t);
+
+/* CRC-32C of p, slicing by 8 bytes. */
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t (*t)[256] = crc32c_table;
+	uint32_t lo, hi;
+
+	crc = ~crc;
+	for (; len >= 8; len -= 8, p += 8) {
+		lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+		    (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+		    t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+		    t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+		    t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+#ifdef CRC32C_SSE42
+/* CRC-32C of p, with the crc32 instruction of SSE4.2. */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c, v;
+
+	c = ~crc;
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+	return ~(uint32_t)c;
+}
+#endif
+
+static void
+crc32c_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc32c_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+			    crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+	crc32c = crc32c_sw;
+#ifdef CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c = crc32c_sse42;
+#endif
+}
+
+/* CRC-32C of the content of fd, and its length in *len. */
+static int
+crc32c_fd(int fd, char *buf, uint32_t *crc, off_t *len)
+{
+	ssize_t n;
+
+	*crc = 0;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (*len = 0; (n = pread(fd, buf, VERIFY_BUFSIZ, *len)) != 0;
+	    *len += n) {
+		if (n == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return -1;
+		}
+		*crc = crc32c(*crc, (unsigned char *)buf, n);
+	}
+	return 0;
+}
+
+/*
+ * Compare the copy f with its source, listing it in the mismatches of
+ * the running job if they differ; return -1 if so.
+ */
+static int
+verify_run(struct cfile *f, char *buf)
+{
+	struct job *j = jobs.cur;
+	uint32_t scrc, dcrc;
+	off_t slen, dlen;
+
+	/* Read the copy back from the device, not from the cache. */
+	if (fdatasync(f->dst) == 0)
+		posix_fadvise(f->dst, 0, 0, POSIX_FADV_DONTNEED);
+	else if (errno != EINVAL)
+		goto mismatch;
+	if (crc32c_fd(f->src, buf, &scrc, &slen) == -1 ||
+	    crc32c_fd(f->dst, buf, &dcrc, &dlen) == -1 ||
+	    slen != dlen || scrc != dcrc)
+		goto mismatch;
+	return 0;
+mismatch:
+	pthread_mutex_lock(&jobs.mtx);
+	j->mismatch = xrealloc(j->mismatch,
+	    (j->nmismatch + 1) * sizeof(*j->mismatch));
+	j->mismatch[j->nmismatch++] = xstrdup(f->verify);
+	wake();
+	pthread_mutex_unlock(&jobs.mtx);
+	return -1;
+}
+
+/* Queue the verification of f, waiting for room. */
+static void
+verify_add(struct cfile *f)
+{
+	pthread_mutex_lock(&verify.mtx);
+	while (verify.n == VERIFY_QUEUE)
+		pthread_cond_wait(&verify.cv, &verify.mtx);
+	verify.queue[(verify.head + verify.n++) % VERIFY_QUEUE] = *f;
+	pthread_cond_broadcast(&verify.cv);
+	pthread_mutex_unlock(&verify.mtx);
+}
+
+/*
+ * Done with the copy f, successful if ret is 0: it's verified, in the
+ * background if async, then journaled.  Its files are closed, and -1
+ * returned on error.
+ */
+static int
+copy_done(struct cfile *f, int ret, int async)
+{
+	char *buf;
+
+	if (ret == 0 && f->verify != NULL) {
+		if (async) {
+			verify_add(f);
+			return 0;
+		}
+		buf = xcalloc(1, VERIFY_BUFSIZ);
+		ret = verify_run(f, buf);
+		free(buf);
+	}
+	free(f->verify);
+	close(f->src);
+	if (close(f->dst) == -1)
+		ret = -1;
+	if (ret == 0)
+		journal_put(f->journal, f->key, -1);
+	return ret;
+}
+
+static void *
+verify_worker(void *arg)
+{
+	struct cfile f;
+	char *buf;
+	int ret;
+
+	buf = xcalloc(1, VERIFY_BUFSIZ);
+	pthread_mutex_lock(&verify.mtx);
+	for (;;) {
+		while (verify.n == 0 && !verify.quit)
+			pthread_cond_wait(&verify.cv, &verify.mtx);
+		if (verify.n == 0)
+			break;
+		f = verify.queue[verify.head];
+		verify.head = (verify.head + 1) % VERIFY_QUEUE;
+		verify.n--;
+		pthread_cond_broadcast(&verify.cv);
+		pthread_mutex_unlock(&verify.mtx);
+		/* Once cancelled, the copies are left unverified. */
+		ret = job_check() ? -1 : verify_run(&f, buf);
+		free(f.verify);
+		f.verify = NULL;
+		copy_done(&f, ret, 0);
+		pthread_mutex_lock(&verify.mtx);
+	}
+	pthread_mutex_unlock(&verify.mtx);
+	free(buf);
+	return NULL;
+}
+
+static void
+verify_start(void)
+{
+	if (crc32c == NULL)
+		crc32c_init();
+	verify.quit = 0;
+	for (verify.nthreads = 0; verify.nthreads < VERIFY_THREADS;
+	    verify.nthreads++)
+		if (pthread_create(&verify.threads[verify.nthreads], NULL,
+		    verify_worker, NULL) != 0)
+			quit("pthread_create");
+}
+
+/* Wait for the copies queued to be verified. */
+static void
+verify_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&verify.mtx);
+	verify.quit = 1;
+	pthread_cond_broadcast(&verify.cv);
+	pthread_mutex_unlock(&verify.mtx);
+	for (i = 0; i < verify.nthreads; i++)
+		pthread_join(verify.threads[i], NULL);
+	verify.nthreads = 0;
+}
+
+#if defined(__linux__) && defined(RV_URING) && defined(SYS_io_uring_setup)
+/*
+ * io_uring(7) engine to copy batches of files.  The data goes in
+ * chunks of URING_BUFSIZ bytes through URING_NBUFS buffers registered
+ * with the kernel: each chunk is read, then written at the same
+ * offset, so the chunks of many files, and of the same file, are in
+ * flight at once.  All the operations ready are submitted, and their
+ * completions waited for, with a single io_uring_enter(2).
+ *
+ * Only regular files of at least URING_MIN bytes are copied this way,
+ * the others are left to copy_data(): writes to new files are mostly
+ * handed to the io-wq threads of the kernel, which costs more than the
+ * copy of a small file.  The threads of a walk queue the files with
+ * uring_add(), and the one filling the queue copies its URING_QUEUE
+ * files while the others go on walking.
+ */
+#define URING_NBUFS  32
+#define URING_BUFSIZ (256 * 1024)
+#define URING_MIN    (1024 * 1024)
+#define URING_QUEUE  64
+
+struct ufile {
+	struct cfile c;
+	off_t next;		/* Offset of the next chunk to read. */
+	int inflight;
+	int eof;
+	int err;
+	int *result;		/* Set to -1 on error. */
+};
+
+struct uchunk {
+	struct ufile *f;	/* NULL if free. */
+	off_t off;
+	size_t want;
+	size_t len;		/* Read so far. */
+	size_t done;		/* Written so far. */
+	int writing;
+};
+
+static struct uring {
+	int state;		/* 0: not set up, 1: ready, -1: unusable. */
+	int fd;
+	int fixed;		/* Buffers registered. */
+	unsigned sent;		/* sq_tail at the last submission. */
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	char *bufs;
+	struct uchunk chunk[URING_NBUFS];
+	struct ufile queue[URING_QUEUE];
+	int nqueue;
+} uring;
+
+static pthread_mutex_t uring_mtx = PTHREAD_MUTEX_INITIALIZER;	/* Queue. */
+static pthread_mutex_t uring_ring = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+uring_init(void)
+{
+	struct io_uring_params p;
+	struct iovec iov[URING_NBUFS];
+	char *sq, *cq;
+	size_t sqlen, cqlen;
+	int i;
+
+	if (uring.state != 0)
+		return uring.state == 1 ? 0 : -1;
+	uring.state = -1;
+	memset(&p, 0, sizeof(p));
+	if ((uring.fd = syscall(SYS_io_uring_setup, URING_NBUFS, &p)) == -1)
+		return -1;
+	sq = cq = MAP_FAILED;
+	uring.sqes = MAP_FAILED;
+	uring.bufs = MAP_FAILED;
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqlen = cqlen = MAX(sqlen, cqlen);
+	sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) &&
+	    (cq = mmap(NULL, cqlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING)) ==
+	    MAP_FAILED)
+		goto fail;
+	uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd,
+	    IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED)
+		goto fail;
+	uring.bufs = mmap(NULL, URING_NBUFS * URING_BUFSIZ,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uring.bufs == MAP_FAILED)
+		goto fail;
+	uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	/* Without registered buffers, plain reads and writes will do. */
+	for (i = 0; i < URING_NBUFS; i++) {
+		iov[i].iov_base = uring.bufs + i * URING_BUFSIZ;
+		iov[i].iov_len = URING_BUFSIZ;
+	}
+	uring.fixed = syscall(SYS_io_uring_register, uring.fd,
+	    IORING_REGISTER_BUFFERS, iov, URING_NBUFS) == 0;
+	uring.state = 1;
+	return 0;
+fail:
+	/* The mappings outlive the ring. */
+	if (sq != MAP_FAILED)
+		munmap(sq, sqlen);
+	if (cq != MAP_FAILED && cq != sq)
+		munmap(cq, cqlen);
+	if (uring.sqes != MAP_FAILED)
+		munmap(uring.sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+	if (uring.bufs != MAP_FAILED)
+		munmap(uring.bufs, URING_NBUFS * URING_BUFSIZ);
+	close(uring.fd);
+	return -1;
+}
+
+/* Queue the next operation of chunk i. */
+static void
+uring_prep(int i)
+{
+	struct uchunk *c = &uring.chunk[i];
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+
+	tail = *uring.sq_tail;
+	sqe = &uring.sqes[tail & *uring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	if (c->writing) {
+		sqe->opcode = uring.fixed ? IORING_OP_WRITE_FIXED :
+		    IORING_OP_WRITE;
+		sqe->fd = c->f->c.dst;
+		sqe->off = c->off + c->done;
+		sqe->addr = (uintptr_t)(uring.bufs + i * URING_BUFSIZ +
+		    c->done);
+		sqe->len = c->len - c->done;
+	} else {
+		sqe->opcode = uring.fixed ? IORING_OP_READ_FIXED :
+		    IORING_OP_READ;
+		sqe->fd = c->f->c.src;
+		sqe->off = c->off + c->len;
+		sqe->addr = (uintptr_t)(uring.bufs + i * URING_BUFSIZ +
+		    c->len);
+		sqe->len = c->want - c->len;
+	}
+	sqe->buf_index = i;
+	sqe->user_data = i;
+	uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Close f once all its chunks are done. */
+static void
+ufile_done(struct ufile *f)
+{
+	if (f->c.src == -1 || f->inflight > 0 ||
+	    (f->next < f->c.size && !f->eof && !f->err))
+		return;
+	if (copy_done(&f->c, f->err ? -1 : 0, 1) == -1)
+		__atomic_store_n(f->result, -1, __ATOMIC_RELAXED);
+	f->c.src = f->c.dst = -1;
+}
+
+/*
+ * Journal the offset up to which f is copied, that of its first chunk
+ * still in flight, as the chunks complete in any order.
+ */
+static void
+ufile_checkpoint(struct ufile *f)
+{
+	off_t off;
+	int i;
+
+	if (f->c.journal == NULL)
+		return;
+	off = f->next;
+	for (i = 0; i < URING_NBUFS; i++)
+		if (uring.chunk[i].f == f)
+			off = MIN(off, uring.chunk[i].off);
+	if (off - f->c.saved >= JOURNAL_STEP) {
+		journal_put(f->c.journal, f->c.key, off);
+		f->c.saved = off;
+	}
+}
+
+/* Handle the completion of an operation of chunk i. */
+static void
+uring_complete(int i, int res, off_t *pending)
+{
+	struct uchunk *c = &uring.chunk[i];
+	struct ufile *f = c->f;
+
+	if (res < 0 || (c->writing && res == 0)) {
+		f->err = 1;
+	} else if (!c->writing) {
+		c->len += res;
+		if (res == 0)
+			f->eof = 1;	/* The file shrank. */
+		if (res > 0 && c->len < c->want) {
+			uring_prep(i);
+			return;
+		}
+		if (c->len > 0) {
+			c->writing = 1;
+			uring_prep(i);
+			return;
+		}
+	} else {
+		c->done += res;
+		copy_progress(pending, res, 0);
+		if (c->done < c->len) {
+			uring_prep(i);
+			return;
+		}
+	}
+	c->f = NULL;
+	f->inflight--;
+	if (!f->err)
+		ufile_checkpoint(f);
+	ufile_done(f);
+}
+
+/*
+ * Copy what's left of the n files with copy_data(), the ring being
+ * unusable.  Those with chunks in flight fail, since the chunks may
+ * still land; the chunks of the others are all written.
+ */
+static void
+uring_fallback(struct ufile *files, int n)
+{
+	struct ufile *f;
+	int i, ret;
+
+	for (i = 0; i < URING_NBUFS; i++)
+		uring.chunk[i].f = NULL;
+	for (i = 0; i < n; i++) {
+		f = &files[i];
+		if (f->c.src == -1)
+			continue;
+		if (f->inflight > 0 || f->err) {
+			f->inflight = 0;
+			f->err = 1;
+			ufile_done(f);
+			continue;
+		}
+		ret = 0;
+		f->c.off = f->next;
+		if (lseek(f->c.src, f->c.off, SEEK_SET) == -1 ||
+		    lseek(f->c.dst, f->c.off, SEEK_SET) == -1)
+			ret = -1;
+		if (ret == 0 && !job_check())
+			ret = copy_data(&f->c);
+		else
+			ret = -1;
+		if (copy_done(&f->c, ret, 1) == -1)
+			__atomic_store_n(f->result, -1, __ATOMIC_RELAXED);
+		f->c.src = f->c.dst = -1;
+	}
+}
+
+/* Copy the n files, with the ring held. */
+static void
+uring_copy(struct ufile *files, int n)
+{
+	struct ufile *cur;
+	struct uchunk *c;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	off_t pending;
+	int i, next, inflight, ret;
+
+	cur = NULL;
+	pending = 0;
+	next = inflight = 0;
+	for (;;) {
+		/* Once cancelled, let the chunks in flight finish only. */
+		if (next < n && job_check()) {
+			if (cur != NULL) {
+				cur->err = 1;
+				ufile_done(cur);
+			}
+			for (; next < n; next++) {
+				files[next].err = 1;
+				ufile_done(&files[next]);
+			}
+		}
+		/* Give the free buffers to the next chunks. */
+		for (i = 0; i < URING_NBUFS; i++) {
+			if (uring.chunk[i].f != NULL)
+				continue;
+			while ((cur == NULL || cur->err || cur->eof ||
+			    cur->next >= cur->c.size) && next < n)
+				cur = &files[next++];
+			if (cur == NULL || cur->err || cur->eof ||
+			    cur->next >= cur->c.size)
+				break;
+			c = &uring.chunk[i];
+			c->f = cur;
+			c->off = cur->next;
+			c->want = MIN(cur->c.size - cur->next, URING_BUFSIZ);
+			c->len = c->done = 0;
+			c->writing = 0;
+			cur->next += c->want;
+			cur->inflight++;
+			inflight++;
+			uring_prep(i);
+		}
+		if (inflight == 0)
+			break;
+		/* Completions may have queued operations too. */
+		ret = syscall(SYS_io_uring_enter, uring.fd,
+		    *uring.sq_tail - uring.sent, 1, IORING_ENTER_GETEVENTS,
+		    NULL, 0);
+		if (ret == -1 && errno != EINTR) {
+			pthread_mutex_lock(&uring_mtx);
+			uring.state = -1;
+			pthread_mutex_unlock(&uring_mtx);
+			uring_fallback(files, n);
+			break;
+		}
+		if (ret > 0)
+			uring.sent += ret;
+		head = *uring.cq_head;
+		tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &uring.cqes[head & *uring.cq_mask];
+			i = cqe->user_data;
+			uring_complete(i, cqe->res, &pending);
+			if (uring.chunk[i].f == NULL)
+				inflight--;
+		}
+		__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	copy_progress(&pending, 0, 1);
+}
+
+/* Copy the files queued, if any. */
+static void
+uring_flush(void)
+{
+	struct ufile files[URING_QUEUE];
+	int n;
+
+	pthread_mutex_lock(&uring_mtx);
+	n = uring.nqueue;
+	memcpy(files, uring.queue, n * sizeof(*files));
+	uring.nqueue = 0;
+	pthread_mutex_unlock(&uring_mtx);
+	if (n == 0)
+		return;
+	pthread_mutex_lock(&uring_ring);
+	/* Only given up with both locks held. */
+	if (uring.state == 1)
+		uring_copy(files, n);
+	else
+		uring_fallback(files, n);
+	pthread_mutex_unlock(&uring_ring);
+}
+
+/*
+ * Queue the copy of cf, whose files are closed once it's done;
+ * *result is set to -1 on error.  Return 0 if the file must be copied
+ * another way.
+ */
+static int
+uring_add(struct cfile *cf, int *result)
+{
+	struct ufile *f;
+	int full;
+
+	if (cf->size - cf->off < URING_MIN)
+		return 0;
+	pthread_mutex_lock(&uring_mtx);
+	if (uring_init() == -1) {
+		pthread_mutex_unlock(&uring_mtx);
+		return 0;
+	}
+	pthread_mutex_unlock(&uring_mtx);
+#ifdef FICLONE
+	if (ioctl(cf->dst, FICLONE, cf->src) == 0) {
+		copy_progress(&cf->pending, cf->size - cf->off, 1);
+		if (copy_done(cf, 0, 1) == -1)
+			__atomic_store_n(result, -1, __ATOMIC_RELAXED);
+		return 1;
+	}
+#endif
+	pthread_mutex_lock(&uring_mtx);
+	f = &uring.queue[uring.nqueue++];
+	memset(f, 0, sizeof(*f));
+	f->c = *cf;
+	f->c.saved = f->next = cf->off;
+	f->result = result;
+	full = uring.nqueue == URING_QUEUE;
+	pthread_mutex_unlock(&uring_mtx);
+	if (full)
+		uring_flush();
+	return 1;
+}
+#else
+static void
+uring_flush(void)
+{
+}
+
+static int
+uring_add(struct cfile *cf, int *result)
+{
+	return 0;
+}
+#endif
+
+/*
+ * The walks of the jobs.  The destination of the entries of a
+ * directory, open in its ufd, is created by enter(), and copy_file()
+ * copies each entry there; with the destination of the job for the
+ * roots.
+ */
+static int
+dst_fd(struct walk *w, struct wnode *dir)
+{
+	return dir ? dir->ufd : ((struct job *)w->arg)->dstfd;
+}
+
+static const char *
+base_name(const char *name)
+{
+	const char *p;
+
+	return (p = strrchr(name, '/')) != NULL ? p + 1 : name;
+}
+
+/* Path of the copy of name, in dir, under the destination of the job. */
+static char *
+dst_path(struct walk *w, struct wnode *dir, const char *name)
+{
+	struct job *j = w->arg;
+	struct wnode *n;
+	const char *s;
+	char *path, *p;
+	size_t len;
+
+	len = strlen(j->dst) + strlen(base_name(name));
+	for (n = dir; n != NULL; n = n->parent)
+		len += strlen(base_name(n->name)) + 1;
+	path = xcalloc(1, len + 1);
+	p = path + len;
+	for (s = base_name(name), n = dir;; s = base_name(n->name),
+	    n = n->parent) {
+		p -= strlen(s);
+		memcpy(p, s, strlen(s));
+		if (n == NULL)
+			break;
+		*--p = '/';
+	}
+	memcpy(path, j->dst, strlen(j->dst));
+	return path;
+}
+
+/*
+ * Copy name, described by st, from dir; if async, the copy may go
+ * through io_uring and be verified in the background.  A file the
+ * journal has as copied is skipped, one partly copied goes on from the
+ * last checkpoint, and both count as done in *units.
+ */
+static int
+copy_file(struct walk *w, struct wnode *dir, const char *name,
+    const struct stat *st, int async, off_t *units)
+{
+	struct job *j = w->arg;
+	struct cfile f;
+	struct stat dst;
+	char target[PATH_MAX];
+	ssize_t n;
+	int sfd, flags, ret;
+
+	memset(&f, 0, sizeof(f));
+	sfd = dir ? dir->fd : AT_FDCWD;
+	if (j->journal != NULL) {
+		f.journal = j->journal;
+		f.key = journal_file(dir ? dir->key : 0, name, st);
+		if ((f.off = journal_get(f.journal, f.key)) == -1) {
+			*units += st->st_size;
+			return 0;
+		}
+	}
+	if (S_ISLNK(st->st_mode)) {
+		if ((n = readlinkat(sfd, name, target,
+		    sizeof(target) - 1)) == -1)
+			return -1;
+		target[n] = '\0';
+		if (symlinkat(target, dst_fd(w, dir), base_name(name)) == -1)
+			return -1;
+		journal_put(f.journal, f.key, -1);
+		/* Counted in the total, see count_leaf(). */
+		*units += st->st_size;
+		return 0;
+	}
+	if ((f.src = openat(sfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC))
+	    == -1)
+		return -1;
+	flags = O_CREAT | O_CLOEXEC | (f.off ? 0 : O_TRUNC) |
+	    (j->verify ? O_RDWR : O_WRONLY);
+	if ((f.dst = openat(dst_fd(w, dir), base_name(name), flags,
+	    st->st_mode)) == -1) {
+		close(f.src);
+		return -1;
+	}
+	ret = 0;
+	/* What was written past the checkpoint may not all be there. */
+	if (f.off > 0 && (fstat(f.dst, &dst) == -1 ||
+	    ftruncate(f.dst, f.off = MIN(f.off, dst.st_size)) == -1 ||
+	    lseek(f.src, f.off, SEEK_SET) == -1 ||
+	    lseek(f.dst, f.off, SEEK_SET) == -1))
+		ret = -1;
+	f.size = st->st_size;
+	f.saved = f.off;
+	*units += f.off;
+	if (j->verify && S_ISREG(st->st_mode))
+		f.verify = dst_path(w, dir, name);
+	if (ret == 0 && async && S_ISREG(st->st_mode) &&
+	    uring_add(&f, &w->err))
+		return 0;
+	if (ret == 0)
+		ret = copy_data(&f);
+	return copy_done(&f, ret, async);
+}
+
+/* Create the destination of directory n. */
+static int
+copy_enter(struct walk *w, struct wnode *n)
+{
+	struct stat st;
+	int dfd;
+
+	dfd = dst_fd(w, n->parent);
+	if (fstat(n->fd, &st) == -1)
+		return -1;
+	n->key = journal_dir(&st);
+	/* Writable until it's left. */
+	if (mkdirat(dfd, base_name(n->name), (st.st_mode & 07777) | S_IRWXU)
+	    == -1 && errno != EEXIST)
+		return -1;
+	n->ufd = openat(dfd, base_name(n->name),
+	    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	return n->ufd == -1 ? -1 : 0;
+}
+
+static int
+copy_leaf(struct walk *w, struct wnode *dir, const char *name, int type,
+    off_t *units)
+{
+	struct stat st;
+
+	if (fstatat(dir ? dir->fd : AT_FDCWD, name, &st,
+	    AT_SYMLINK_NOFOLLOW) == -1)
+		return -1;
+	if (S_ISDIR(st.st_mode))
+		return 1;
+	return copy_file(w, dir, name, &st, 1, units);
+}
+
+/* Give the destination of n the mode of n. */
+static int
+copy_leave(struct walk *w, struct wnode *n)
+{
+	struct stat st;
+
+	if (fstat(n->fd, &st) == -1)
+		return 0;
+	return fchmod(n->ufd, st.st_mode & 07777);
+}
+
+/*
+ * Entries are moved with renameat(2), or copied then deleted across
+ * file systems.  The copy doesn't go through io_uring, as the source
+ * is deleted as soon as it returns.
+ */
+static int
+move_leaf(struct walk *w, struct wnode *dir, const char *name, int type,
+    off_t *units)
+{
+	struct job *j = w->arg;
+	struct stat st;
+	int sfd, dfd;
+
+	sfd = dir ? dir->fd : AT_FDCWD;
+	dfd = dst_fd(w, dir);
+	if (fstatat(sfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+		return -1;
+	if (S_ISDIR(st.st_mode))
+		return 1;
+	if (!__atomic_load_n(&j->exdev, __ATOMIC_RELAXED)) {
+		if (renameat(sfd, name, dfd, base_name(name)) == 0) {
+			*units += st.st_size;
+			return 0;
+		}
+		if (errno != EXDEV)
+			return -1;
+		__atomic_store_n(&j->exdev, 1, __ATOMIC_RELAXED);
+	}
+	if (copy_file(w, dir, name, &st, 0, units) == -1)
+		return -1;
+	return unlinkat(sfd, name, 0);
+}
+
+static int
+move_leave(struct walk *w, struct wnode *n)
+{
+	if (copy_leave(w, n) == -1)
+		return -1;
+	return unlinkat(n->parent ? n->parent->fd : AT_FDCWD, n->name,
+	    AT_REMOVEDIR);
+}
+
+/*
+ * Deletions need no stat(2) when d_type is known; otherwise unlinking
+ * tells the directories apart.  Progress is counted in entries.
+ */
+static int
+del_leaf(struct walk *w, struct wnode *dir, const char *name, int type,
+    off_t *units)
+{
+	struct stat st;
+	int fd;
+
+	fd = dir ? dir->fd : AT_FDCWD;
+	if (unlinkat(fd, name, 0) == 0) {
+		(*units)++;
+		return 0;
+	}
+	if (type == DT_UNKNOWN && (errno == EISDIR || errno == EPERM) &&
+	    fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+	    S_ISDIR(st.st_mode))
+		return 1;
+	return -1;
+}
+
+static int
+del_leave(struct walk *w, struct wnode *n)
+{
+	if (unlinkat(n->parent ? n->parent->fd : AT_FDCWD, n->name,
+	    AT_REMOVEDIR) == -1)
+		return -1;
+	update_progress(1);
+	return 0;
+}
+
+static int
+job_step(struct walk *w, off_t units)
+{
+	if (units)
+		update_progress(units);
+	return job_check();
+}
+
+/* Milliseconds job j has been running for, pauses excluded. */
+static long
+job_ms(const struct job *j)
+{
+	long ms;
+
+	if (j->state == JOB_QUEUED)
+		return 0;
+	if (j->state != JOB_RUNNING)
+		return j->ms;
+	if (j->paused)
+		ms = (j->stopped.tv_sec - j->start.tv_sec) * 1000 +
+		    (j->stopped.tv_nsec - j->start.tv_nsec) / 1000000;
+	else
+		ms = elapsed_ms(&j->start);
+	return ms - j->pausedms;
 }
 
 /*
- * Process all marked entries using CWD as destination root.  All
- * marked entries that are directories will be recursively processed.
- * See process_dir() for details on the parameters.
+ * Process the entries of job j.  Marked directories are walked from
+ * their file descriptors, see walk_dir(), and a directory is moved
+ * with a single rename(2) whenever possible.
  */
 static void
-process_marked(PROCESS pre, PROCESS proc, PROCESS pos, const char *msg_doing,
-    const char *msg_done)
+job_run(struct job *j)
 {
-	int i, ret;
-	char *entry;
-	char path[PATH_MAX];
-
-	clear_message();
-	message(CYAN, "%s...", msg_doing);
-	refresh();
-	fm.prog = (struct prog){0, count_marked(), msg_doing};
-	for (i = 0; i < fm.marks.bulk; i++) {
-		entry = fm.marks.entries[i];
-		if (entry) {
+	struct walk w;
+	const char *path;
+	char name[NAME_MAX + 1];
+	size_t len, srclen;
+	int i, ret, isdir;
+
+	j->dstfd = -1;
+	j->exdev = 0;
+	if (j->op != JOB_DELETE && (j->dstfd = open(j->dst,
+	    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		pthread_mutex_lock(&jobs.mtx);
+		for (i = 0; i < j->nsrc; i++)
+			j->result[i] = -1;
+		j->nerrors = j->nsrc;
+		pthread_mutex_unlock(&jobs.mtx);
+		return;
+	}
+	count_start(j);
+	if (j->verify)
+		verify_start();
+	for (i = 0; i < j->nsrc && !job_check(); i++) {
+		path = j->src[i];
+		len = strlen(path);
+		srclen = len - 1;
+		while (srclen > 0 && path[srclen - 1] != '/')
+			srclen--;
+		isdir = ISDIR(path + srclen);
+		if (j->op != JOB_DELETE &&
+		    ((isdir && !strncmp(path, j->dst, len)) ||
+		    (strlen(j->dst) == srclen &&
+		    !strncmp(path, j->dst, srclen)))) {
+			/* Into itself, or onto itself. */
+			ret = -1;
+		} else if (j->op == JOB_MOVE && isdir &&
+		    snprintf(name, sizeof(name), "%.*s",
+		    (int)(len - 1 - srclen), path + srclen) <
+		    (int)sizeof(name) &&
+		    renameat(AT_FDCWD, path, j->dstfd, name) == 0) {
 			ret = 0;
-			snprintf(path, PATH_MAX, "%s%s", fm.marks.dirpath,
-			    entry);
-			if (ISDIR(entry)) {
-				if (!strncmp(path, CWD, strlen(path)))
-					ret = -1;
-				else
-					ret = process_dir(pre, proc, pos, path);
-			} else
-				ret = proc(path);
-			if (!ret) {
-				del_mark(&fm.marks, entry);
-				reload();
+		} else {
+			walk_init(&w);
+			switch (j->op) {
+			case JOB_COPY:
+				w.enter = copy_enter;
+				w.leaf = copy_leaf;
+				w.leave = copy_leave;
+				break;
+			case JOB_MOVE:
+				w.enter = copy_enter;
+				w.leaf = move_leaf;
+				w.leave = move_leave;
+				break;
+			default:
+				w.leaf = del_leaf;
+				w.leave = del_leave;
+				break;
 			}
+			w.step = job_step;
+			w.arg = j;
+			walk_push(&w, NULL, path);
+			walk_threads(&w, pool.nthreads + 1);
+			uring_flush();
+			ret = w.err ? -1 : 0;
+			walk_free(&w);
 		}
+		pthread_mutex_lock(&jobs.mtx);
+		j->result[i] = ret;
+		if (ret)
+			j->nerrors++;
+		pthread_mutex_unlock(&jobs.mtx);
 	}
-	fm.prog.total = 0;
-	reload();
-	if (!fm.marks.nentries)
-		message(GREEN, "%s all marked entries.", msg_done);
-	else
-		message(RED, "Some errors occured while %s.", msg_doing);
-	RV_ALERT();
+	if (j->verify)
+		verify_stop();
+	count_stop();
+	if (j->dstfd != -1)
+		close(j->dstfd);
+}
+
+static void *
+job_worker(void *arg)
+{
+	struct job *j;
+
+	pthread_mutex_lock(&jobs.mtx);
+	while (!jobs.quit) {
+		for (j = jobs.head; j != NULL; j = j->next)
+			if (j->state == JOB_QUEUED)
+				break;
+		if (j == NULL) {
+			pthread_cond_wait(&jobs.cv, &jobs.mtx);
+			continue;
+		}
+		j->state = JOB_RUNNING;
+		clock_gettime(CLOCK_MONOTONIC, &j->start);
+		j->stopped = j->start;
+		jobs.cur = j;
+		pthread_mutex_unlock(&jobs.mtx);
+		job_run(j);
+		pthread_mutex_lock(&jobs.mtx);
+		/* Those cut short by quitting are resumed next time. */
+		journal_close(j, !(j->cancel && jobs.quit));
+		j->ms = job_ms(j);
+		if (j->cancel)
+			j->state = JOB_CANCELLED;
+		else if (j->nerrors || j->nmismatch)
+			j->state = JOB_FAILED;
+		else
+			j->state = JOB_DONE;
+		jobs.cur = NULL;
+		wake();
+	}
+	pthread_mutex_unlock(&jobs.mtx);
+	return NULL;
 }
 
 static void
-update_progress(off_t delta)
+jobs_init(void)
 {
-	int percent;
+	pthread_mutex_init(&jobs.mtx, NULL);
+	pthread_cond_init(&jobs.cv, NULL);
+	if (pthread_create(&jobs.thread, NULL, job_worker, NULL) != 0)
+		quit("pthread_create");
+}
 
-	if (!fm.prog.total)
-		return;
-	fm.prog.partial += delta;
-	percent = (int)(fm.prog.partial * 100 / fm.prog.total);
-	message(CYAN, "%s...%d%%", fm.prog.msg, percent);
-	refresh();
+static void
+job_free(struct job *j)
+{
+	int i;
+
+	journal_close(j, 0);
+	for (i = 0; i < j->nsrc; i++)
+		free(j->src[i]);
+	free(j->src);
+	for (i = 0; i < j->nmismatch; i++)
+		free(j->mismatch[i]);
+	free(j->mismatch);
+	free(j->result);
+	free(j);
 }
 
-/* Wrappers for file operations. */
-static int
-delfile(const char *path)
+/* Cancel the jobs left and wait for the running one to stop. */
+static void
+jobs_stop(void)
 {
-	int ret;
-	struct stat st;
+	struct job *j;
+
+	pthread_mutex_lock(&jobs.mtx);
+	jobs.quit = 1;
+	for (j = jobs.head; j != NULL; j = j->next)
+		j->cancel = 1;
+	pthread_cond_broadcast(&jobs.cv);
+	pthread_mutex_unlock(&jobs.mtx);
+	pthread_join(jobs.thread, NULL);
+	while ((j = jobs.head) != NULL) {
+		jobs.head = j->next;
+		job_free(j);
+	}
+}
 
-	ret = lstat(path, &st);
-	if (ret < 0)
-		return ret;
-	update_progress(st.st_size);
-	return unlink(path);
+/* Whether the jobs view is shown in place of the listing. */
+static int
+jobs_viewing(void)
+{
+	return jobs.viewing;
 }
 
+/* Number of jobs queued or running. */
 static int
-addfile(const char *path)
+jobs_busy(void)
 {
-	/* Using creat(2) because mknod(2) doesn't seem to be portable. */
-	int ret;
+	struct job *j;
+	int n;
+
+	n = 0;
+	pthread_mutex_lock(&jobs.mtx);
+	for (j = jobs.head; j != NULL; j = j->next)
+		if (j->state == JOB_QUEUED || j->state == JOB_RUNNING)
+			n++;
+	pthread_mutex_unlock(&jobs.mtx);
+	return n;
+}
 
-	ret = creat(path, 0644);
-	if (ret < 0)
-		return ret;
-	return close(ret);
+static const char *
+job_name(enum jobop op)
+{
+	static const char *names[] = { "copy", "move", "delete" };
+
+	return names[op];
 }
 
-static int
-cpyfile(const char *srcpath)
+/*
+ * Queue a job processing the marked entries, with CWD as destination
+ * root.  The marks are handed over to the job: those it fails to
+ * process are marked again once it's over, see jobs_idle().
+ */
+static void
+job_submit(enum jobop op)
 {
-	int src, dst, ret;
-	size_t size;
-	struct stat st;
-	char buf[BUFSIZ];
-	char dstpath[PATH_MAX];
+	struct job *j, **tail;
+	struct mpath *entry;
+	char path[PATH_MAX];
+	int i;
 
-	strlcpy(dstpath, CWD, sizeof(dstpath));
-	strlcat(dstpath, srcpath + strlen(fm.marks.dirpath), sizeof(dstpath));
-	ret = lstat(srcpath, &st);
-	if (ret < 0)
-		return ret;
-	if (S_ISLNK(st.st_mode)) {
-		ret = readlink(srcpath, BUF1, BUFLEN - 1);
-		if (ret < 0)
-			return ret;
-		BUF1[ret] = '\0';
-		ret = symlink(BUF1, dstpath);
-	} else {
-		ret = src = open(srcpath, O_RDONLY);
-		if (ret < 0)
-			return ret;
-		ret = dst = creat(dstpath, st.st_mode);
-		if (ret < 0)
-			return ret;
-		while ((size = read(src, buf, BUFSIZ)) > 0) {
-			write(dst, buf, size);
-			update_progress(size);
-			sync_signals();
-		}
-		close(src);
-		close(dst);
-		ret = 0;
+	if (!fm.marks.nentries) {
+		message(RED, "No entries marked.");
+		return;
 	}
-	return ret;
+	j = xcalloc(1, sizeof(*j));
+	j->op = op;
+	if (op != JOB_DELETE) {
+		strlcpy(j->dst, CWD, sizeof(j->dst));
+		j->verify = fm.verify;
+	}
+	j->src = xcalloc(fm.marks.nentries, sizeof(*j->src));
+	j->result = xcalloc(fm.marks.nentries, sizeof(*j->result));
+	for (i = 0; (entry = next_mark(&fm.marks, &i)) != NULL; ) {
+		mark_path(entry, path, sizeof(path));
+		j->result[j->nsrc] = 1;
+		j->src[j->nsrc++] = xstrdup(path);
+	}
+	mark_none(&fm.marks);
+	mark_rows();
+	if (op != JOB_DELETE)
+		journal_create(j);
+	pthread_mutex_lock(&jobs.mtx);
+	j->id = ++jobs.lastid;
+	for (tail = &jobs.head; *tail != NULL; tail = &(*tail)->next)
+		;
+	*tail = j;
+	pthread_cond_broadcast(&jobs.cv);
+	pthread_mutex_unlock(&jobs.mtx);
+	message(CYAN, "Job %d: %s of %d entries queued.", j->id,
+	    job_name(op), j->nsrc);
 }
 
+/* Progress of job j, in percent, or -1 if unknown yet. */
 static int
-adddir(const char *path)
+job_percent(const struct job *j)
 {
-	int ret;
-	struct stat st;
+	int percent;
 
-	ret = stat(CWD, &st);
-	if (ret < 0)
-		return ret;
-	return mkdir(path, st.st_mode);
+	if (j->total == 0)
+		return -1;
+	percent = (int)(MIN(j->partial, j->total) * 100 / j->total);
+	/* The total is only known once the count is over. */
+	if (percent > 99 && j->state == JOB_RUNNING && !count_done())
+		percent = 99;
+	return percent;
 }
 
-static int
-movfile(const char *srcpath)
+/*
+ * Describe the jobs left on the top line, e.g. "42%+2" for a job 42%
+ * done with two more queued.
+ */
+static void
+jobs_status(char *buf, size_t size)
 {
-	int ret;
-	struct stat st;
-	char dstpath[PATH_MAX];
-
-	strlcpy(dstpath, CWD, sizeof(dstpath));
-	strlcat(dstpath, srcpath + strlen(fm.marks.dirpath), sizeof(dstpath));
-	ret = rename(srcpath, dstpath);
-	if (ret == 0) {
-		ret = lstat(dstpath, &st);
-		if (ret < 0)
-			return ret;
-		update_progress(st.st_size);
-	} else if (errno == EXDEV) {
-		ret = cpyfile(srcpath);
-		if (ret < 0)
-			return ret;
-		ret = unlink(srcpath);
+	struct job *j;
+	int percent, nqueued;
+
+	percent = -2;
+	nqueued = 0;
+	pthread_mutex_lock(&jobs.mtx);
+	for (j = jobs.head; j != NULL; j = j->next)
+		if (j->state == JOB_QUEUED)
+			nqueued++;
+		else if (j->state == JOB_RUNNING)
+			percent = job_percent(j);
+	pthread_mutex_unlock(&jobs.mtx);
+	buf[0] = '\0';
+	if (percent == -1)
+		strlcpy(buf, "...", size);
+	else if (percent >= 0)
+		snprintf(buf, size, "%d%%", percent);
+	if (nqueued)
+		snprintf(buf + strlen(buf), size - strlen(buf), "+%d", nqueued);
+}
+
+/*
+ * Report the jobs over, mark again the entries they failed to process,
+ * and the copies that differ, and reload the listing if they touched
+ * it.
+ */
+static void
+jobs_idle(void)
+{
+	struct job *j, **p;
+	char status[sizeof(jobs.shown)], msg[128];
+	enum color c;
+	int i, n, touched, remark;
+
+	touched = remark = 0;
+	msg[0] = '\0';
+	c = DEFAULT;
+	pthread_mutex_lock(&jobs.mtx);
+	for (j = jobs.head; j != NULL; j = j->next) {
+		/* Copies that differ are shown as they're found. */
+		if (j->nshown < j->nmismatch) {
+			c = RED;
+			snprintf(msg, sizeof(msg), "Job %d: %s differs.",
+			    j->id, base_name(j->mismatch[j->nmismatch - 1]));
+			j->nshown = j->nmismatch;
+		}
+		if (j->reported || j->state < JOB_DONE)
+			continue;
+		j->reported = 1;
+		touched |= !strcmp(j->dst, CWD);
+		for (i = 0; i < j->nsrc; i++) {
+			n = strlen(j->src[i]) - 1;
+			while (n > 0 && j->src[i][n - 1] != '/')
+				n--;
+			touched |= !strncmp(j->src[i], CWD, n) &&
+			    CWD[n] == '\0';
+			if (j->result[i] == 0)
+				continue;
+			strlcpy(BUF2, j->src[i], MIN(n + 1, BUFLEN));
+			add_mark(&fm.marks, BUF2, j->src[i] + n);
+			remark = 1;
+		}
+		for (i = 0; i < j->nmismatch; i++) {
+			n = base_name(j->mismatch[i]) - j->mismatch[i];
+			strlcpy(BUF2, j->mismatch[i], MIN(n + 1, BUFLEN));
+			add_mark(&fm.marks, BUF2, j->mismatch[i] + n);
+			remark = 1;
+		}
+		/* Shown once the listing is reloaded. */
+		if (j->state == JOB_DONE) {
+			c = GREEN;
+			snprintf(msg, sizeof(msg), "Job %d: %s done.", j->id,
+			    job_name(j->op));
+		} else if (j->state == JOB_CANCELLED) {
+			c = YELLOW;
+			snprintf(msg, sizeof(msg), "Job %d: %s cancelled.",
+			    j->id, job_name(j->op));
+		} else if (j->nerrors) {
+			c = RED;
+			snprintf(msg, sizeof(msg),
+			    "Job %d: %s failed for %d entries.", j->id,
+			    job_name(j->op), j->nerrors);
+		} else {
+			c = RED;
+			snprintf(msg, sizeof(msg),
+			    "Job %d: %s done, copies differing: %d.", j->id,
+			    job_name(j->op), j->nmismatch);
+		}
+	}
+	/* Forget the oldest jobs over. */
+	n = 0;
+	for (j = jobs.head; j != NULL; j = j->next)
+		n += j->reported;
+	for (p = &jobs.head; n > JOBS_KEEP && (j = *p) != NULL; )
+		if (j->reported) {
+			*p = j->next;
+			job_free(j);
+			n--;
+		} else
+			p = &j->next;
+	pthread_mutex_unlock(&jobs.mtx);
+	if (touched)
+		reload();
+	else if (remark)
+		mark_rows();
+	if (msg[0] != '\0') {
+		message(c, "%s", msg);
+		RV_ALERT();
+	}
+	if (jobs.viewing)
+		return;
+	jobs_status(status, sizeof(status));
+	if (remark || strcmp(status, jobs.shown) != 0) {
+		strlcpy(jobs.shown, status, sizeof(jobs.shown));
+		update_view();
 	}
-	return ret;
 }
 
 static void
@@ -1245,6 +5380,23 @@ cmd_jump_bottom(void)
 static void
 cmd_cd_down(void)
 {
+	char path[PATH_MAX], *name;
+
+	if (fm.nfiles && fm.find[0] != '\0' && !S_ISDIR(EMODE(ESEL))) {
+		/* Go to the directory of the hit. */
+		strlcpy(path, ENAME(ESEL), sizeof(path));
+		if ((name = strrchr(path, '/')) != NULL) {
+			*name++ = '\0';
+			if (ENAME(ESEL)[0] == '/')
+				CWD[0] = '\0';
+			strlcat(CWD, path, sizeof(CWD));
+			strlcat(CWD, "/", sizeof(CWD));
+		} else
+			name = path;
+		cd(1);
+		load_select(name, 1);
+		return;
+	}
 	if (!fm.nfiles || !S_ISDIR(EMODE(ESEL)))
 		return;
 	if (chdir(ENAME(ESEL)) == -1) {
@@ -1260,6 +5412,13 @@ cmd_cd_up(void)
 {
 	char *dirname, first;
 
+	if (fm.find[0] != '\0') {
+		/* Back to the listing of CWD. */
+		cd(0);
+		ESEL = finder.esel;
+		SCROLL = finder.scroll;
+		return;
+	}
 	if (!strcmp(CWD, "/"))
 		return;
 
@@ -1272,11 +5431,9 @@ cmd_cd_up(void)
 	dirname[0] = '\0';
 	cd(1);
 	dirname[0] = first;
-	strlcat(dirname, "/", sizeof(dirname));
-	try_to_sel(dirname);
+	strlcat(dirname, "/", sizeof(CWD) - (dirname - CWD));
+	load_select(dirname, 1);
 	dirname[0] = '\0';
-	if (fm.nfiles > HEIGHT)
-		SCROLL = ESEL - HEIGHT / 2;
 }
 
 static void
@@ -1343,7 +5500,7 @@ cmd_paste_path(void)
 	if (strcmp(CWD, "/") != 0)
 		strlcat(CWD, "/", sizeof(CWD));
 	cd(1);
-	try_to_sel(nl+1);
+	load_select(nl + 1, 0);
 	return;
 
 err:
@@ -1356,6 +5513,14 @@ cmd_reload(void)
 	reload();
 }
 
+static void
+cmd_cache_info(void)
+{
+	message(CYAN, "cache: %lu hits, %lu misses, %d listings, %zu KiB",
+	    cache.hits, cache.misses, cache.nentries, cache.mem / 1024);
+	refresh();
+}
+
 static void
 cmd_shell(void)
 {
@@ -1411,39 +5576,406 @@ cmd_open(void)
 static void
 cmd_mark(void)
 {
+	const char *entry;
+	char dir[PATH_MAX];
+
+	entry = row_entry(ESEL, dir, sizeof(dir));
 	if (MARKED(ESEL))
-		del_mark(&fm.marks, ENAME(ESEL));
+		del_mark(&fm.marks, dir, entry);
 	else
-		add_mark(&fm.marks, CWD, ENAME(ESEL));
+		add_mark(&fm.marks, dir, entry);
 
-	MARKED(ESEL) = !MARKED(ESEL);
+	SETMARK(ESEL, !MARKED(ESEL));
 	ESEL = (ESEL + 1) % fm.nfiles;
 }
 
 static void
 cmd_toggle_mark(void)
 {
+	const char *entry;
+	char dir[PATH_MAX];
 	int i;
 
 	for (i = 0; i < fm.nfiles; ++i) {
+		entry = row_entry(i, dir, sizeof(dir));
 		if (MARKED(i))
-			del_mark(&fm.marks, ENAME(i));
+			del_mark(&fm.marks, dir, entry);
 		else
-			add_mark(&fm.marks, CWD, ENAME(ESEL));
-		MARKED(i) = !MARKED(i);
+			add_mark(&fm.marks, dir, entry);
+		SETMARK(i, !MARKED(i));
 	}
 }
 
 static void
 cmd_mark_all(void)
 {
+	const char *entry;
+	char dir[PATH_MAX];
 	int i;
 
 	for (i = 0; i < fm.nfiles; ++i)
 		if (!MARKED(i)) {
-			add_mark(&fm.marks, CWD, ENAME(ESEL));
-			MARKED(i) = 1;
+			entry = row_entry(i, dir, sizeof(dir));
+			add_mark(&fm.marks, dir, entry);
+			SETMARK(i, 1);
+		}
+}
+
+/* Ask a yes or no question on the status bar. */
+static int
+confirm(const char *question)
+{
+	int ch;
+
+	message(YELLOW, "%s (y/N)", question);
+	refresh();
+	ch = fm_getch();
+	clear_message();
+	return ch == 'y' || ch == 'Y';
+}
+
+static void
+cmd_copy(void)
+{
+	job_submit(JOB_COPY);
+}
+
+static void
+cmd_move(void)
+{
+	job_submit(JOB_MOVE);
+}
+
+static void
+cmd_delete(void)
+{
+	if (!fm.marks.nentries)
+		return;
+	snprintf(BUF2, BUFLEN, "Delete %d marked entries?",
+	    fm.marks.nentries);
+	if (confirm(BUF2))
+		job_submit(JOB_DELETE);
+}
+
+/*
+ * Incremental search: the first entry whose name contains the input
+ * is selected as it's typed.  When the input still contains the
+ * previous one, only the previous matches are looked at again.
+ */
+#define SEARCH_CHUNK    4096
+
+struct search {
+	const char *query;
+	int *rows;		/* Matches, in listing order. */
+	uint8_t *hit;
+};
+
+static void
+search_rows(void *arg, size_t start, size_t end)
+{
+	struct search *s = arg;
+	size_t i;
+
+	for (i = start; i < end; i++)
+		s->hit[i] = strstr(ENAME(s->rows[i]), s->query) != NULL;
+}
+
+static void
+cmd_search(void)
+{
+	struct search s;
+	char prev[BUFLEN];
+	enum editstate state;
+	enum color c;
+	unsigned int version;
+	int oldsel, oldscroll, i, j, n;
+
+	if (!fm.nfiles)
+		return;
+	oldsel = ESEL;
+	oldscroll = SCROLL;
+	memset(&s, 0, sizeof(s));
+	prev[0] = '\0';
+	version = fm.version;
+	n = 0;
+	start_line_edit("");
+	update_input(RVP_SEARCH, DEFAULT);
+	while ((state = get_line_edit()) == CONTINUE) {
+		c = DEFAULT;
+		if (INPUT[0] == '\0') {
+			ESEL = oldsel;
+			SCROLL = oldscroll;
+		} else {
+			if (prev[0] == '\0' || version != fm.version ||
+			    strstr(INPUT, prev) == NULL) {
+				s.rows = xrealloc(s.rows,
+				    MAX(fm.nfiles, 1) * sizeof(*s.rows));
+				s.hit = xrealloc(s.hit, MAX(fm.nfiles, 1));
+				for (n = 0; n < fm.nfiles; n++)
+					s.rows[n] = n;
+				version = fm.version;
+			}
+			s.query = INPUT;
+			pool_run(search_rows, &s, n, SEARCH_CHUNK);
+			for (i = j = 0; i < n; i++)
+				if (s.hit[i])
+					s.rows[j++] = s.rows[i];
+			n = j;
+			c = RED;
+			if (n) {
+				c = GREEN;
+				ESEL = s.rows[0];
+				SCROLL = ESEL - 3;
+			}
+		}
+		strlcpy(prev, INPUT, sizeof(prev));
+		update_view();
+		update_input(RVP_SEARCH, c);
+	}
+	if (state == CANCEL) {
+		ESEL = oldsel;
+		SCROLL = oldscroll;
+	}
+	free(s.rows);
+	free(s.hit);
+	clear_message();
+}
+
+/* Find the entries below CWD whose name matches the pattern read. */
+static void
+cmd_find(void)
+{
+	enum editstate state;
+
+	start_line_edit("");
+	update_input(RVP_FIND, DEFAULT);
+	while ((state = get_line_edit()) == CONTINUE)
+		update_input(RVP_FIND, DEFAULT);
+	clear_message();
+	if (state == CONFIRM && INPUT[0] != '\0')
+		find_start(INPUT, 0);
+}
+
+/*
+ * Find the files containing the string read, among the marked entries
+ * if any, below CWD otherwise.
+ */
+static void
+cmd_grep(void)
+{
+	enum editstate state;
+
+	start_line_edit("");
+	update_input(RVP_GREP, DEFAULT);
+	while ((state = get_line_edit()) == CONTINUE)
+		update_input(RVP_GREP, DEFAULT);
+	clear_message();
+	if (state == CONFIRM && INPUT[0] != '\0')
+		find_start(INPUT, 1);
+}
+
+/* Stop the find in progress, if any, keeping what it found. */
+static void
+cmd_stop(void)
+{
+	find_finish();
+}
+
+/* Toggle the verification of the copies of the jobs submitted next. */
+static void
+cmd_verify(void)
+{
+	fm.verify = !fm.verify;
+	message(CYAN, "Copies are %s verified.",
+	    fm.verify ? "now" : "no longer");
+}
+
+/* Draw the job at line i of the jobs view. */
+static void
+draw_job(int i, const struct job *j, int sel)
+{
+	static const char *states[] = {
+		"queued", "running", "interrupted", "done", "failed",
+		"cancelled"
+	};
+	char done[24], total[24], rate[24], eta[32], state[24], pct[16];
+	long ms, secs;
+	int percent;
+
+	ms = job_ms(j);
+	percent = job_percent(j);
+	rate[0] = eta[0] = '\0';
+	/* Deletions count entries. */
+	if (j->op == JOB_DELETE) {
+		snprintf(done, sizeof(done), "%lld", (long long)j->partial);
+		snprintf(total, sizeof(total), "%lld", (long long)j->total);
+		if (ms > 0)
+			snprintf(rate, sizeof(rate), "%lld/s",
+			    (long long)(j->partial * 1000 / ms));
+	} else {
+		human_size(done, sizeof(done), j->partial);
+		human_size(total, sizeof(total), j->total);
+		if (ms > 0) {
+			human_size(rate, sizeof(rate), j->partial * 1000 / ms);
+			strlcat(rate, "/s", sizeof(rate));
+		}
+	}
+	if (j->state == JOB_RUNNING && j->partial > 0 && percent >= 0 &&
+	    percent < 100) {
+		secs = (long)((double)(j->total - j->partial) * ms /
+		    j->partial / 1000);
+		snprintf(eta, sizeof(eta), "%ld:%02ld:%02ld", secs / 3600,
+		    secs / 60 % 60, secs % 60);
+	}
+	strlcpy(state, states[j->state], sizeof(state));
+	if (j->paused && j->state < JOB_DONE)
+		strlcpy(state, "paused", sizeof(state));
+	else if (j->state == JOB_FAILED && j->nerrors)
+		snprintf(state, sizeof(state), "%d errors", j->nerrors);
+	else if (j->state == JOB_FAILED)
+		snprintf(state, sizeof(state), "%d differ", j->nmismatch);
+	if (percent >= 0)
+		snprintf(pct, sizeof(pct), "%3d%%", percent);
+	else
+		strlcpy(pct, "    ", sizeof(pct));
+	snprintf(BUF1, BUFLEN, "%3d %-6s %-11s %s %9s/%-9s %11s %8s  ",
+	    j->id, job_name(j->op), state, pct, done, total, rate, eta);
+	strlcat(BUF1, j->src[0], BUFLEN);
+	if (j->nsrc > 1)
+		strlcat(BUF1, " ...", BUFLEN);
+	if (j->op != JOB_DELETE) {
+		strlcat(BUF1, " -> ", BUFLEN);
+		strlcat(BUF1, j->dst, BUFLEN);
+	}
+	if (i == sel)
+		wattr_on(fm.window, A_REVERSE, NULL);
+	if (j->state == JOB_FAILED)
+		wcolor_set(fm.window, RED, NULL);
+	else if (j->state == JOB_CANCELLED || j->state == JOB_INTERRUPTED)
+		wcolor_set(fm.window, YELLOW, NULL);
+	else if (j->state == JOB_DONE)
+		wcolor_set(fm.window, GREEN, NULL);
+	else if (j->state == JOB_RUNNING)
+		wcolor_set(fm.window, RVC_STATUS, NULL);
+	else
+		wcolor_set(fm.window, DEFAULT, NULL);
+	mbstowcs(WBUF, BUF1, PATH_MAX);
+	mvwhline(fm.window, i + 1, 1, ' ', COLS - 2);
+	mvwaddnwstr(fm.window, i + 1, 2, WBUF, COLS - 4);
+	if (i == sel)
+		wattr_off(fm.window, A_REVERSE, NULL);
+}
+
+/* Draw the jobs view, keeping job *sel visible; return the jobs. */
+static int
+draw_jobs(int *sel)
+{
+	struct job *j;
+	int i, n, scroll;
+
+	pthread_mutex_lock(&jobs.mtx);
+	for (n = 0, j = jobs.head; j != NULL; j = j->next)
+		n++;
+	*sel = MAX(MIN(*sel, n - 1), 0);
+	scroll = MAX(*sel - HEIGHT + 1, 0);
+	for (i = 0, j = jobs.head; j != NULL && i - scroll < HEIGHT;
+	    i++, j = j->next)
+		if (i >= scroll)
+			draw_job(i - scroll, j, *sel - scroll);
+	pthread_mutex_unlock(&jobs.mtx);
+	for (i -= scroll; i < HEIGHT; i++)
+		mvwhline(fm.window, i + 1, 1, ' ', COLS - 2);
+	mvhline(0, 0, ' ', COLS);
+	color_set(RVC_CWD, NULL);
+	mvaddstr(0, 0, "jobs");
+	wcolor_set(fm.window, RVC_BORDER, NULL);
+	wborder(fm.window, 0, 0, 0, 0, 0, 0, 0, 0);
+	mvhline(LINES - 1, 0, ' ', COLS);
+	color_set(RVC_STATUS, NULL);
+	mvaddstr(LINES - 1, 0, "p: pause/resume  c: cancel  q: back");
+	snprintf(BUF1, BUFLEN, "%d/%d", n ? *sel + 1 : 0, n);
+	mvaddstr(LINES - 1, COLS - 1 - strlen(BUF1), BUF1);
+	color_set(DEFAULT, NULL);
+	wrefresh(fm.window);
+	return n;
+}
+
+/*
+ * Pause or resume, or cancel, the job at index sel of the list.  An
+ * interrupted job is resumed by queueing it again.
+ */
+static void
+job_control(int sel, int cancel)
+{
+	struct job *j;
+	struct timespec now;
+
+	pthread_mutex_lock(&jobs.mtx);
+	for (j = jobs.head; j != NULL && sel > 0; j = j->next)
+		sel--;
+	if (j == NULL || j->state >= JOB_DONE)
+		goto done;
+	if (cancel) {
+		j->cancel = 1;
+		/* Not started yet: nothing to wait for. */
+		if (j->state == JOB_QUEUED || j->state == JOB_INTERRUPTED) {
+			j->state = JOB_CANCELLED;
+			journal_close(j, 1);
+		}
+	} else if (j->state == JOB_INTERRUPTED) {
+		j->state = JOB_QUEUED;
+	} else if (j->paused) {
+		if (j->state == JOB_RUNNING)
+			j->pausedms += elapsed_ms(&j->stopped);
+		j->paused = 0;
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		j->stopped = now;
+		j->paused = 1;
+	}
+	pthread_cond_broadcast(&jobs.cv);
+done:
+	pthread_mutex_unlock(&jobs.mtx);
+}
+
+/* Show the jobs, with their progress, until the user goes back. */
+static void
+cmd_jobs(void)
+{
+	int ch, sel, n;
+
+	jobs.viewing = 1;
+	sel = 0;
+	for (;;) {
+		n = draw_jobs(&sel);
+		if ((ch = getch()) == ERR) {
+			idle();
+			wait_event();
+			continue;
+		}
+		switch (ch) {
+		case 'j':
+		case KEY_DOWN:
+			sel = MIN(sel + 1, n - 1);
+			break;
+		case 'k':
+		case KEY_UP:
+			sel = MAX(sel - 1, 0);
+			break;
+		case 'p':
+			job_control(sel, 0);
+			break;
+		case 'c':
+			job_control(sel, 1);
+			break;
+		case 'q':
+		case 'w':
+		case '\e':
+			jobs.viewing = 0;
+			clear();
+			return;
 		}
+	}
 }
 
 static void
@@ -1460,24 +5992,32 @@ loop(void)
 #define X_QUIT 2
 		int flags;
 	} bindings[] = {
+		{'/',		0,	cmd_search,		X_UPDV},
 		{'<',		K_META,	cmd_jump_top,		X_UPDV},
 		{'>',		K_META,	cmd_jump_bottom,	X_UPDV},
 		{'?',		0,	cmd_man,		0},
+		{'C',		0,	cmd_copy,		X_UPDV},
+		{'F',		0,	cmd_find,		X_UPDV},
 		{'G',		0,	cmd_jump_bottom,	X_UPDV},
 		{'H',		0,	cmd_home,		X_UPDV},
 		{'J',		0,	cmd_scroll_down,	X_UPDV},
 		{'K',		0,	cmd_scroll_up,		X_UPDV},
 		{'M',		0,	cmd_mark_all,		X_UPDV},
 		{'P',		0,	cmd_paste_path,		X_UPDV},
+		{'S',		0,	cmd_grep,		X_UPDV},
+		{'V',		0,	cmd_move,		X_UPDV},
 		{'V',		K_CTRL,	cmd_scroll_down,	X_UPDV},
+		{'X',		0,	cmd_delete,		X_UPDV},
 		{'Y',		0,	cmd_copy_path,		X_UPDV},
 		{'^',		0,	cmd_cd_up,		X_UPDV},
 		{'b',		0,	cmd_cd_up,		X_UPDV},
+		{'c',		0,	cmd_verify,		X_UPDV},
 		{'e',		0,	cmd_edit,		X_UPDV},
 		{'f',		0,	cmd_cd_down,		X_UPDV},
 		{'g',		0,	cmd_jump_top,		X_UPDV},
-		{'g',		K_CTRL,	NULL,			X_UPDV},
+		{'g',		K_CTRL,	cmd_stop,		X_UPDV},
 		{'h',		0,	cmd_cd_up,		X_UPDV},
+		{'i',		0,	cmd_cache_info,		0},
 		{'j',		0,	cmd_down,		X_UPDV},
 		{'k',		0,	cmd_up,			X_UPDV},
 		{'l',		0,	cmd_cd_down,		X_UPDV},
@@ -1493,6 +6033,7 @@ loop(void)
 		{'t',		0,	cmd_toggle_mark,	X_UPDV},
 		{'v',		0,	cmd_view,		X_UPDV},
 		{'v',		K_META,	cmd_scroll_up,		X_UPDV},
+		{'w',		0,	cmd_jobs,		X_UPDV},
 		{KEY_DOWN,	0,	cmd_scroll_down,	X_UPDV},
 		{KEY_NPAGE,	0,	cmd_scroll_down,	X_UPDV},
 		{KEY_PPAGE,	0,	cmd_scroll_up,		X_UPDV},
@@ -1500,10 +6041,24 @@ loop(void)
 		{KEY_RESIZE,	K_META,	NULL,			X_UPDV},
 		{KEY_UP,	0,	cmd_scroll_up,		X_UPDV},
 	}, *b;
+	struct timespec frame;
 	size_t i;
+	int dirty = 0;
 
+	clock_gettime(CLOCK_MONOTONIC, &frame);
 	for (;;) {
 	again:
+		/*
+		 * Keys that are already pending, as during auto-repeat or
+		 * on a slow terminal, are applied before the screen is
+		 * drawn again, and it's drawn at most RV_FPS times a
+		 * second.
+		 */
+		if (dirty && !key_pending(&frame)) {
+			update_view();
+			clock_gettime(CLOCK_MONOTONIC, &frame);
+			dirty = 0;
+		}
 		meta = 0;
 		ch = fm_getch();
 		if (ch == '\e') {
@@ -1524,12 +6079,20 @@ loop(void)
 			if ((!meta && b->chflags & K_META) || ch != c)
 				continue;
 
-			if (b->flags & X_QUIT)
-				return;
+			if (b->flags & X_QUIT) {
+				if (dirty) {
+					update_view();
+					dirty = 0;
+				}
+				if (!jobs_busy() ||
+				    confirm("Cancel the jobs left and quit?"))
+					return;
+				goto again;
+			}
 			if (b->fn != NULL)
 				b->fn();
 			if (b->flags & X_UPDV)
-				update_view();
+				dirty = 1;
 
 			goto again;
 		}
@@ -1552,13 +6115,14 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-	int i, ch;
-	char *entry;
+	int i, ch, ninterrupted;
+	struct mpath *mark;
+	char path[PATH_MAX];
 	DIR *d;
 	FILE *save_cwd_file = NULL;
 	FILE *save_marks_file = NULL;
 
-	if (pledge("stdio rpath wpath cpath tty proc exec", NULL) == -1)
+	if (pledge("stdio rpath wpath cpath fattr flock tty proc exec", NULL) == -1)
 		err(1, "pledge");
 
 	while ((ch = getopt_long(argc, argv, "d:hm:v", opts, NULL)) != -1) {
@@ -1583,6 +6147,10 @@ main(int argc, char *argv[])
 	}
 
 	get_user_programs();
+	pool_init(get_stat_threads());
+	jobs_init();
+	ninterrupted = journals_load();
+	notify_init();
 	init_term();
 	fm.nfiles = 0;
 	for (i = 0; i < 10; i++) {
@@ -1613,22 +6181,26 @@ main(int argc, char *argv[])
 	strlcpy(clipboard, CWD, sizeof(clipboard));
 	if (fm.nfiles > 0)
 		strlcat(clipboard, ENAME(ESEL), sizeof(clipboard));
+	if (ninterrupted)
+		message(YELLOW, "Jobs interrupted: %d, resume them from the "
+		    "jobs view.", ninterrupted);
 
 	loop();
 
-	if (fm.nfiles)
-		free_rows(&fm.rows, fm.nfiles);
+	jobs_stop();
+	load_abort();
+	find_stop();
+	rows_free(&fm.rows);
+	cache_clear();
 	delwin(fm.window);
 	if (save_cwd_file != NULL) {
 		fputs(CWD, save_cwd_file);
 		fclose(save_cwd_file);
 	}
 	if (save_marks_file != NULL) {
-		for (i = 0; i < fm.marks.bulk; i++) {
-			entry = fm.marks.entries[i];
-			if (entry)
-				fprintf(save_marks_file, "%s%s\n",
-				    fm.marks.dirpath, entry);
+		for (i = 0; (mark = next_mark(&fm.marks, &i)) != NULL; ) {
+			mark_path(mark, path, sizeof(path));
+			fprintf(save_marks_file, "%s\n", path);
 		}
 		fclose(save_marks_file);
 	}
@@ -0,0 +1,112 @@
+/*
+ * Benchmark of the sort of the listings: n generated names, one in ten
+ * a directory, are sorted the way fm used to, with qsort(3) and
+ * strcoll(3), and the way it does now, on collation keys with
+ * key_rows() and sort_rows().  Both orders are checked to agree.
+ *
+ * usage: sortbench [n]
+ * The locale is taken from the environment, e.g. LC_ALL=en_US.UTF-8.
+ */
+#define main fm_main
+int main(int, char *[]);
+#include "fm.c"
+#undef main
+
+struct oldrow {
+	const char *name;
+	mode_t mode;
+};
+
+static int
+oldcmp(const void *a, const void *b)
+{
+	const struct oldrow *r1 = a, *r2 = b;
+	int cmpdir;
+
+	cmpdir = S_ISDIR(r2->mode) - S_ISDIR(r1->mode);
+	return cmpdir ? cmpdir : strcoll(r1->name, r2->name);
+}
+
+static double
+seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *words[] = {
+		"Makefile", "README", "build", "cache", "config", "data",
+		"Documents", "fm", "image", "log", "notes", "photo", "src",
+		"test", "été", "über", "_tmp", "zeta",
+	};
+	static const char *exts[] = {
+		"", ".c", ".h", ".jpg", ".log", ".md", ".o", ".txt",
+	};
+	struct rows r;
+	struct oldrow *old;
+	const char *collate;
+	char *names;
+	uint32_t rnd = 2463534242u;
+	double t0, told, tnew;
+	char name[NAME_MAX + 1];
+	int i, n;
+
+	n = argc > 1 ? atoi(argv[1]) : 1000000;
+	if (n < 1)
+		errx(1, "usage: sortbench [n]");
+	setlocale(LC_ALL, "");
+	collate = setlocale(LC_COLLATE, NULL);
+	collate_bytes = collate == NULL || !strcmp(collate, "C") ||
+	    !strcmp(collate, "POSIX") || !strncmp(collate, "C.", 2);
+	pool_init(get_stat_threads());
+
+	memset(&r, 0, sizeof(r));
+	rows_grow(&r, n);
+	old = xcalloc(n, sizeof(*old));
+	for (i = 0; i < n; i++) {
+		/* xorshift32 */
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 17;
+		rnd ^= rnd << 5;
+		snprintf(name, sizeof(name), "%s-%u%s",
+		    words[rnd % nitems(words)], rnd >> 8,
+		    exts[(rnd >> 4) % nitems(exts)]);
+		r.name[i] = arena_alloc(&r.names, strlen(name) + 2);
+		strcpy(r.names.buf + r.name[i], name);
+		r.mode[i] = rnd % 10 == 0 ? S_IFDIR : S_IFREG;
+		r.size[i] = 0;
+		r.flags[i] = 0;
+	}
+	/* key_rows() may move the arena. */
+	names = xcalloc(r.names.len, 1);
+	memcpy(names, r.names.buf, r.names.len);
+	for (i = 0; i < n; i++) {
+		old[i].name = names + r.name[i];
+		old[i].mode = r.mode[i];
+	}
+
+	t0 = seconds();
+	qsort(old, n, sizeof(*old), oldcmp);
+	told = seconds() - t0;
+
+	t0 = seconds();
+	key_rows(&r, 0, n);
+	sort_rows(&r, n);
+	tnew = seconds() - t0;
+
+	for (i = 0; i < n; i++)
+		if (r.mode[i] != old[i].mode ||
+		    strcoll(r.names.buf + r.name[i], old[i].name) != 0)
+			errx(1, "orders differ at row %d: %s, %s", i,
+			    r.names.buf + r.name[i], old[i].name);
+	printf("%d names, LC_COLLATE=%s, %d threads\n", n,
+	    collate ? collate : "C", pool.nthreads + 1);
+	printf("qsort+strcoll %.3fs, keys+radix %.3fs (%.1fx)\n", told, tnew,
+	    told / tnew);
+	return 0;
+}